@@ -0,0 +1,287 @@
+"""NumPy interface to vinverse through the C functions exported by the plugin dll.
+
+Planes are uint8 arrays of shape (H, W) or batches of shape (N, H, W). They are handed to the dll
+without copies as long as their rows meet the alignment the simd kernels need (16 bytes for pointers
+and row strides, see aligned_empty); other inputs are copied into an aligned buffer first. ctypes
+releases the GIL for the duration of every call. The planes of a batch are filtered in parallel by
+one call into the dll, on the scheduler threads the plugin shares with everything else in the process.
+
+The dll is looked up in VINVERSE_LIBRARY, then next to this file.
+"""
+
+import ctypes
+import os
+from collections import namedtuple
+
+import numpy as np
+
+__all__ = ["Vinverse", "VinverseError", "VinverseResult", "VinverseStream", "aligned_empty", "vinverse", "vinverse2"]
+
+_MODES = {"vinverse": 0, "vinverse2": 1}
+_RADII = {"vinverse": (1, 2), "vinverse2": (1, 1)}
+_TAPS = {"binomial": 0, "flat": 1}
+_ERRORS = {-1: "invalid argument", -2: "misaligned plane", -3: "out of memory"}
+
+VinverseResult = namedtuple("VinverseResult", ["output", "aux", "stats"])
+
+
+class VinverseError(RuntimeError):
+    pass
+
+
+class _Plane(ctypes.Structure):
+    _fields_ = [
+        ("srcp", ctypes.c_void_p), ("src_pitch", ctypes.c_int),
+        ("dstp", ctypes.c_void_p), ("dst_pitch", ctypes.c_int),
+        ("auxp", ctypes.c_void_p), ("aux_pitch", ctypes.c_int),
+        ("maskp", ctypes.c_void_p), ("mask_pitch", ctypes.c_int),
+        ("width", ctypes.c_int), ("height", ctypes.c_int),
+        ("luma", ctypes.c_int),
+        ("x", ctypes.c_int), ("y", ctypes.c_int), ("w", ctypes.c_int), ("h", ctypes.c_int),
+    ]
+
+
+class _Stats(ctypes.Structure):
+    _fields_ = [("change", ctypes.c_uint64), ("clamped", ctypes.c_uint64), ("scaled", ctypes.c_uint64)]
+
+
+_library = None
+
+
+def _load():
+    global _library
+    if _library is None:
+        path = os.environ.get("VINVERSE_LIBRARY") or os.path.join(os.path.dirname(os.path.abspath(__file__)), "vinverse.dll")
+        lib = ctypes.CDLL(path)
+        lib.vinverse_create.restype = ctypes.c_void_p
+        lib.vinverse_create.argtypes = [ctypes.c_int, ctypes.c_float, ctypes.c_int, ctypes.c_float] + [ctypes.c_int] * 7
+        lib.vinverse_destroy.restype = None
+        lib.vinverse_destroy.argtypes = [ctypes.c_void_p]
+        lib.vinverse_alignment.restype = ctypes.c_int
+        lib.vinverse_alignment.argtypes = [ctypes.c_void_p]
+        lib.vinverse_process.restype = ctypes.c_int
+        lib.vinverse_process.argtypes = [ctypes.c_void_p, ctypes.POINTER(_Plane), ctypes.POINTER(_Stats)]
+        lib.vinverse_process_batch.restype = ctypes.c_int
+        lib.vinverse_process_batch.argtypes = [ctypes.c_void_p, ctypes.POINTER(_Plane), ctypes.c_int, ctypes.POINTER(_Stats)]
+        lib.vinverse_stream_begin.restype = ctypes.c_int
+        lib.vinverse_stream_begin.argtypes = [ctypes.c_void_p, ctypes.POINTER(_Plane), ctypes.POINTER(ctypes.c_void_p)]
+        lib.vinverse_stream_push.restype = ctypes.c_int
+        lib.vinverse_stream_push.argtypes = [ctypes.c_void_p, ctypes.c_int]
+        lib.vinverse_stream_flush.restype = ctypes.c_int
+        lib.vinverse_stream_flush.argtypes = [ctypes.c_void_p, ctypes.POINTER(_Stats)]
+        _library = lib
+    return _library
+
+
+def aligned_empty(shape, alignment=16):
+    """Uninitialized uint8 array whose planes and rows start on alignment boundaries.
+
+    The rows are padded to a multiple of the alignment; the returned array is a view of the first
+    shape[-1] columns, so it can be passed to Vinverse without a copy.
+    """
+    shape = tuple(shape)
+    width = shape[-1]
+    pitch = (width + alignment - 1) // alignment * alignment
+    count = int(np.prod(shape[:-1])) * pitch
+    raw = np.empty(count + alignment, dtype=np.uint8)
+    offset = -raw.ctypes.data % alignment
+    return raw[offset:offset + count].reshape(shape[:-1] + (pitch,))[..., :width]
+
+
+def _is_aligned(array, alignment):
+    if array.dtype != np.uint8 or array.strides[-1] != 1:
+        return False
+    return array.ctypes.data % alignment == 0 and all(stride % alignment == 0 for stride in array.strides[:-1])
+
+
+def _as_batch(array):
+    return array[np.newaxis] if array.ndim == 2 else array
+
+
+class Vinverse(object):
+    """Processor for planes up to width x height with one set of parameters.
+
+    mode, sstr, amnt, scl, r1, r2 and taps are the parameters of vinverse()/vinverse2(); r1 and r2
+    default to the radii of the mode and taps is "binomial" or "flat". stats=True adds the per-plane
+    change statistics to the result and aux=1 or aux=2 an auxiliary plane, as the filter parameters of
+    the same names. There is no uv parameter: luma and chroma planes are passed separately with the luma
+    flag, which only matters for vinverse2. The output is written through the cache, as with nt=0.
+    threads caps how many planes of a batch are filtered at once; by default the dll's thread budget
+    does (see vinverse_set_threads).
+    """
+
+    def __init__(self, width, height, mode="vinverse", sstr=2.7, amnt=255, scl=0.25, stats=False, aux=0, threads=None, r1=None, r2=None, taps="binomial"):
+        # set first, so __del__ has nothing to close if anything below raises
+        self._handle = None
+        self._lib = _load()
+        r1 = r1 or _RADII[mode][0]
+        r2 = r2 or _RADII[mode][1]
+        self._handle = self._lib.vinverse_create(_MODES[mode], sstr, amnt, scl, r1, r2, _TAPS[taps], int(stats), aux, width, height)
+        if not self._handle:
+            raise VinverseError("invalid parameters or out of memory")
+        self.alignment = self._lib.vinverse_alignment(self._handle)
+        self.stats = stats
+        self.aux = aux
+        self.threads = threads
+
+    def close(self):
+        if self._handle:
+            self._lib.vinverse_destroy(self._handle)
+            self._handle = None
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *exc):
+        self.close()
+
+    def __del__(self):
+        self.close()
+
+    def _aligned(self, array):
+        array = np.asarray(array, dtype=np.uint8)
+        if _is_aligned(array, self.alignment):
+            return array
+        copy = aligned_empty(array.shape, self.alignment)
+        copy[...] = array
+        return copy
+
+    def process(self, src, luma=True, x=0, y=0, w=0, h=0, mask=None, out=None, aux_out=None):
+        """Filters src, a (H, W) plane or an (N, H, W) batch, into out and returns a VinverseResult.
+
+        out and aux_out are allocated when not given and have to be aligned when they are. stats is an
+        array of (change, clamped, scaled) rows, one per plane, or None without stats.
+        """
+        src = self._aligned(src)
+        if src.ndim not in (2, 3):
+            raise ValueError("expected a (H, W) plane or an (N, H, W) batch")
+        if out is None:
+            out = aligned_empty(src.shape, self.alignment)
+        elif out.shape != src.shape or not _is_aligned(out, self.alignment):
+            raise ValueError("out must be an aligned uint8 array of the same shape as src")
+        if self.aux:
+            if aux_out is None:
+                aux_out = aligned_empty(src.shape, self.alignment)
+            elif aux_out.shape != src.shape or not _is_aligned(aux_out, self.alignment):
+                raise ValueError("aux_out must be an aligned uint8 array of the same shape as src")
+        if mask is not None:
+            mask = np.ascontiguousarray(mask, dtype=np.uint8)
+            if mask.shape != src.shape:
+                raise ValueError("mask must have the same shape as src")
+
+        srcs, outs = _as_batch(src), _as_batch(out)
+        auxs = _as_batch(aux_out) if self.aux else None
+        masks = _as_batch(mask) if mask is not None else None
+        planes = (_Plane * len(srcs))()
+        for i, plane in enumerate(planes):
+            plane.srcp, plane.src_pitch = srcs[i].ctypes.data, srcs[i].strides[0]
+            plane.dstp, plane.dst_pitch = outs[i].ctypes.data, outs[i].strides[0]
+            if auxs is not None:
+                plane.auxp, plane.aux_pitch = auxs[i].ctypes.data, auxs[i].strides[0]
+            if masks is not None:
+                plane.maskp, plane.mask_pitch = masks[i].ctypes.data, masks[i].strides[0]
+            plane.height, plane.width = srcs[i].shape
+            plane.luma = int(luma)
+            plane.x, plane.y, plane.w, plane.h = x, y, w, h
+        totals = (_Stats * len(srcs))()
+
+        step = self.threads or len(srcs)
+        for start in range(0, len(srcs), step):
+            count = min(step, len(srcs) - start)
+            error = self._lib.vinverse_process_batch(self._handle, ctypes.cast(ctypes.byref(planes, start * ctypes.sizeof(_Plane)), ctypes.POINTER(_Plane)),
+                                                     count, ctypes.cast(ctypes.byref(totals, start * ctypes.sizeof(_Stats)), ctypes.POINTER(_Stats)))
+            if error:
+                raise VinverseError(_ERRORS.get(error, "error %d" % error))
+        stats = np.array([(t.change, t.clamped, t.scaled) for t in totals], dtype=np.uint64)
+
+        if src.ndim == 2:
+            stats = stats[0]
+        return VinverseResult(out, aux_out, stats if self.stats else None)
+
+    def stream(self, src, luma=True, out=None, aux_out=None):
+        """Starts filtering src, an aligned (H, W) plane that is still being filled in from the top.
+
+        src isn't copied, so it has to be aligned already (see aligned_empty) and stay alive until the
+        stream is flushed, as do out and aux_out, which are allocated when not given. Returns a
+        VinverseStream. Regions and masks aren't supported here.
+        """
+        if src.ndim != 2 or not _is_aligned(src, self.alignment):
+            raise ValueError("src must be an aligned (H, W) uint8 plane")
+        if out is None:
+            out = aligned_empty(src.shape, self.alignment)
+        elif out.shape != src.shape or not _is_aligned(out, self.alignment):
+            raise ValueError("out must be an aligned uint8 array of the same shape as src")
+        if self.aux:
+            if aux_out is None:
+                aux_out = aligned_empty(src.shape, self.alignment)
+            elif aux_out.shape != src.shape or not _is_aligned(aux_out, self.alignment):
+                raise ValueError("aux_out must be an aligned uint8 array of the same shape as src")
+        else:
+            aux_out = None
+        return VinverseStream(self, src, out, aux_out, luma)
+
+
+class VinverseStream(object):
+    """One plane filtered as its rows arrive, from Vinverse.stream.
+
+    push(rows) reports that the next rows of src from the top are filled in and returns how many rows
+    of out (and aux_out) from the top are final. flush() filters the remaining rows, ends the stream and
+    returns the VinverseResult.
+    """
+
+    def __init__(self, processor, src, out, aux_out, luma):
+        self._handle = None
+        self._lib = processor._lib
+        self._processor = processor
+        self._arrays = (src, out, aux_out)
+        plane = _Plane()
+        plane.srcp, plane.src_pitch = src.ctypes.data, src.strides[0]
+        plane.dstp, plane.dst_pitch = out.ctypes.data, out.strides[0]
+        if aux_out is not None:
+            plane.auxp, plane.aux_pitch = aux_out.ctypes.data, aux_out.strides[0]
+        plane.height, plane.width = src.shape
+        plane.luma = int(luma)
+        handle = ctypes.c_void_p()
+        error = self._lib.vinverse_stream_begin(processor._handle, ctypes.byref(plane), ctypes.byref(handle))
+        if error:
+            raise VinverseError(_ERRORS.get(error, "error %d" % error))
+        self._handle = handle.value
+
+    def push(self, rows):
+        if not self._handle:
+            raise VinverseError("stream already flushed")
+        finished = self._lib.vinverse_stream_push(self._handle, rows)
+        if finished < 0:
+            raise VinverseError(_ERRORS.get(finished, "error %d" % finished))
+        return finished
+
+    def flush(self):
+        if not self._handle:
+            raise VinverseError("stream already flushed")
+        totals = _Stats()
+        self._lib.vinverse_stream_flush(self._handle, ctypes.byref(totals))
+        self._handle = None
+        stats = np.array((totals.change, totals.clamped, totals.scaled), dtype=np.uint64)
+        src, out, aux_out = self._arrays
+        return VinverseResult(out, aux_out, stats if self._processor.stats else None)
+
+    def __del__(self):
+        if self._handle:
+            self.flush()
+
+
+def _filter(mode, src, sstr, amnt, scl, r1, r2, taps, luma, x, y, w, h, mask, stats, aux, threads):
+    src = np.asarray(src)
+    with Vinverse(src.shape[-1], src.shape[-2], mode, sstr, amnt, scl, stats, aux, threads, r1, r2, taps) as processor:
+        result = processor.process(src, luma, x, y, w, h, mask)
+    return result if stats or aux else result.output
+
+
+def vinverse(src, sstr=2.7, amnt=255, scl=0.25, luma=True, x=0, y=0, w=0, h=0, mask=None, stats=False, aux=0, threads=None, r1=1, r2=2, taps="binomial"):
+    """vinverse() on a plane or a batch of planes; returns a VinverseResult when stats or aux is set."""
+    return _filter("vinverse", src, sstr, amnt, scl, r1, r2, taps, luma, x, y, w, h, mask, stats, aux, threads)
+
+
+def vinverse2(src, sstr=2.7, amnt=255, scl=0.25, luma=True, x=0, y=0, w=0, h=0, mask=None, stats=False, aux=0, threads=None, r1=1, r2=1, taps="binomial"):
+    """vinverse2() on a plane or a batch of planes; returns a VinverseResult when stats or aux is set."""
+    return _filter("vinverse2", src, sstr, amnt, scl, r1, r2, taps, luma, x, y, w, h, mask, stats, aux, threads)
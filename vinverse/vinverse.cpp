@@ -2,413 +2,1572 @@
 #define NOMINMAX
 #include <Windows.h>
 #include "avisynth.h"
+#define VINVERSE_BUILD
+#include "vinverse_api.h"
+#include "vinverse_kernels.h"
 #include <math.h>
 #include <malloc.h>
-#include <emmintrin.h>
+#include <intrin.h>
 #include <stdint.h>
+#include <string.h>
+#include <stdio.h>
 #include <algorithm>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <thread>
+#include <functional>
+#include <memory>
+#include <string>
+#include <new>
 
 
 inline bool is_ptr_aligned(const void *ptr, size_t align) {
     return (((uintptr_t)ptr & ((uintptr_t)(align-1))) == 0);
 }
 
-static void vertical_blur3_c(uint8_t* dstp, const uint8_t *srcp, int dst_pitch, int src_pitch, int width, int height) {
-    for (int y=0; y<height; ++y) {
-        const uint8_t *srcpp = y == 0 ? srcp+src_pitch : srcp-src_pitch;
-        const uint8_t *srcpn = y == height-1 ? srcp-src_pitch : srcp+src_pitch;
+//largest data cache of the given level in bytes, 0 if it can't be determined
+static size_t get_cache_size(int level) {
+    DWORD length = 0;
+    GetLogicalProcessorInformation(nullptr, &length);
+    if (GetLastError() != ERROR_INSUFFICIENT_BUFFER) {
+        return 0;
+    }
+    std::vector<SYSTEM_LOGICAL_PROCESSOR_INFORMATION> info(length / sizeof(SYSTEM_LOGICAL_PROCESSOR_INFORMATION));
+    if (!GetLogicalProcessorInformation(info.data(), &length)) {
+        return 0;
+    }
+    size_t size = 0;
+    for (auto &entry : info) {
+        if (entry.Relationship == RelationCache && entry.Cache.Level == level && entry.Cache.Type != CacheInstruction) {
+            size = std::max(size, size_t(entry.Cache.Size));
+        }
+    }
+    return size;
+}
+
+//AviSynth 2.6 has no flag for AVX2. AviSynth+ reports it with this bit, and detect_cpu_flags sets the
+//same bit from cpuid for hosts that don't.
+static const long CPUF_AVX2 = 0x2000;
+
+PlanePipeline::PlanePipeline(const PipelineParams &params, const PlaneDesc &plane, uint8_t *blur3_buffer, uint8_t *blur6_buffer, int pb_pitch)
+: params_(params), plane_(plane), blur3_buffer(blur3_buffer), blur6_buffer(blur6_buffer), pb3(blur3_buffer), pb3_pitch(pb_pitch), pb_pitch(pb_pitch), src_rows(0)
+{
+    //vinverse2 doesn't sharpen chroma, so its "blur3" is the source itself and is read in place instead of being copied
+    if (params.mode == VinverseMode::Vinverse2 && !plane.luma) {
+        pb3 = plane.srcp;
+        pb3_pitch = plane.src_pitch;
+    }
+    std::fill(done, done + STAGE_COUNT, 0);
+    std::fill(next, next + STAGE_COUNT, 0);
+}
+
+int PlanePipeline::push_rows(int count) {
+    src_rows = std::min(src_rows + count, plane_.height);
+    params_.step(*this);
+    return done[BLUR6];
+}
+
+//The tiers in order of preference, each needing the flags of the ones below it as well
+enum class KernelTier {
+    Avx2,
+    Sse41,
+    Ssse3,
+    Sse2,
+    Plain
+};
+
+static KernelTier select_kernel_tier(long cpu_flags) {
+    const long sse2 = CPUF_SSE2, ssse3 = sse2 | CPUF_SSSE3, sse41 = ssse3 | CPUF_SSE4_1, avx2 = sse41 | CPUF_AVX2;
+    if ((cpu_flags & avx2) == avx2) {
+        return KernelTier::Avx2;
+    }
+    if ((cpu_flags & sse41) == sse41) {
+        return KernelTier::Sse41;
+    }
+    if ((cpu_flags & ssse3) == ssse3) {
+        return KernelTier::Ssse3;
+    }
+    return (cpu_flags & sse2) ? KernelTier::Sse2 : KernelTier::Plain;
+}
+
+static PlaneSteps select_plane_steps(long cpu_flags, VinverseMode mode, bool amnt_255, bool with_stats, AuxOutput aux) {
+    switch (select_kernel_tier(cpu_flags)) {
+    case KernelTier::Avx2: return make_avx2_plane_steps(mode, amnt_255, with_stats, aux);
+    case KernelTier::Sse41: return make_plane_steps<SimdKernels<Sse41> >(mode, amnt_255, with_stats, aux);
+    case KernelTier::Ssse3: return make_plane_steps<SimdKernels<Ssse3> >(mode, amnt_255, with_stats, aux);
+    case KernelTier::Sse2: return make_plane_steps<SimdKernels<Sse2> >(mode, amnt_255, with_stats, aux);
+    default: return make_plane_steps<PlainKernels>(mode, amnt_255, with_stats, aux);
+    }
+}
+
+//the draft steps fall back to the regular ones without SSE2
+static PlaneSteps select_draft_steps(long cpu_flags, VinverseMode mode, bool amnt_255, bool with_stats, AuxOutput aux) {
+    switch (select_kernel_tier(cpu_flags)) {
+    case KernelTier::Avx2: return make_avx2_draft_steps(mode, amnt_255, with_stats, aux);
+    case KernelTier::Sse41: return make_plane_steps<DraftKernels<Sse41> >(mode, amnt_255, with_stats, aux);
+    case KernelTier::Ssse3: return make_plane_steps<DraftKernels<Ssse3> >(mode, amnt_255, with_stats, aux);
+    case KernelTier::Sse2: return make_plane_steps<DraftKernels<Sse2> >(mode, amnt_255, with_stats, aux);
+    default: return select_plane_steps(cpu_flags, mode, amnt_255, with_stats, aux);
+    }
+}
+
+//Large pages are opt-in with the environment variable VINVERSE_LARGE_PAGES=1, since using them means
+//enabling a privilege in the token of the host process.
+static bool large_pages_requested() {
+    char value[8];
+    DWORD length = GetEnvironmentVariableA("VINVERSE_LARGE_PAGES", value, sizeof(value));
+    return length > 0 && length < sizeof(value) && strcmp(value, "0") != 0;
+}
+
+//Large pages need SeLockMemoryPrivilege, which has to be granted to the account and then enabled in the process token.
+static bool enable_lock_memory_privilege() {
+    HANDLE token;
+    if (!OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &token)) {
+        return false;
+    }
+    TOKEN_PRIVILEGES privileges;
+    privileges.PrivilegeCount = 1;
+    privileges.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+    bool enabled = LookupPrivilegeValue(nullptr, SE_LOCK_MEMORY_NAME, &privileges.Privileges[0].Luid)
+        && AdjustTokenPrivileges(token, FALSE, &privileges, 0, nullptr, nullptr)
+        && GetLastError() == ERROR_SUCCESS;
+    CloseHandle(token);
+    return enabled;
+}
 
-        for (int x = 0; x < width; ++x) {
-            dstp[x] = (srcpp[x]+(srcp[x]<<1)+srcpn[x]+2)>>2;
+//Scratch is allocated on the thread that first runs GetFrame, not the one that built the filter. Normal pages
+//are only backed on first touch and large pages are backed at allocation, either way the memory ends up on the
+//NUMA node of the processing thread. When large pages were requested and the account is allowed to use them,
+//buffers of at least one large page use them, which saves most TLB misses on UHD planes.
+//The compilers this is built with don't guard the construction of function-local statics against other
+//threads, so the once_flags and what they guard live at namespace scope and are set up when the dll loads.
+static std::once_flag large_pages_once;
+static bool large_pages;
+
+static void *alloc_scratch(size_t size) {
+    std::call_once(large_pages_once, [] {
+        large_pages = large_pages_requested() && GetLargePageMinimum() > 0 && enable_lock_memory_privilege();
+    });
+    if (large_pages) {
+        const size_t large_page_size = GetLargePageMinimum();
+        if (size >= large_page_size) {
+            void *ptr = VirtualAlloc(nullptr, (size + large_page_size - 1) / large_page_size * large_page_size, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+            if (ptr != nullptr) {
+                return ptr;
+            }
         }
+    }
+    return VirtualAlloc(nullptr, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+}
 
-        srcp += src_pitch;
-        dstp += dst_pitch;
+static void free_scratch(void *ptr) {
+    if (ptr != nullptr) {
+        VirtualFree(ptr, 0, MEM_RELEASE);
     }
 }
 
-static void vertical_blur3_sse2(uint8_t* dstp, const uint8_t *srcp, int dst_pitch, int src_pitch, int width, int height) {
-    int mod16_width = (width+15) / 16 * 16;
+typedef DWORD (WINAPI *GetCurrentProcessorNumberFn)();
+typedef BOOL (WINAPI *GetNumaProcessorNodeFn)(UCHAR processor, PUCHAR node);
+
+//NUMA node of the processor the calling thread runs on, 0 when it can't be told. GetCurrentProcessorNumber
+//is missing on XP, so both are looked up at runtime.
+static std::once_flag numa_resolve_once;
+static GetCurrentProcessorNumberFn get_processor;
+static GetNumaProcessorNodeFn get_node;
+
+static int current_numa_node() {
+    std::call_once(numa_resolve_once, [] {
+        HMODULE kernel32 = GetModuleHandleA("kernel32.dll");
+        if (kernel32 != nullptr) {
+            get_processor = reinterpret_cast<GetCurrentProcessorNumberFn>(GetProcAddress(kernel32, "GetCurrentProcessorNumber"));
+            get_node = reinterpret_cast<GetNumaProcessorNodeFn>(GetProcAddress(kernel32, "GetNumaProcessorNode"));
+        }
+    });
+    UCHAR node;
+    if (get_processor == nullptr || get_node == nullptr || !get_node(static_cast<UCHAR>(get_processor()), &node)) {
+        return 0;
+    }
+    return node;
+}
 
-    auto zero = _mm_setzero_si128();
-    auto two = _mm_set1_epi16(2);
+typedef BOOL (WINAPI *GetNumaHighestNodeNumberFn)(PULONG highest);
+typedef BOOL (WINAPI *GetNumaNodeProcessorMaskFn)(UCHAR node, PULONGLONG mask);
+typedef BOOL (WINAPI *GetNumaNodeProcessorMaskExFn)(USHORT node, PGROUP_AFFINITY affinity);
+typedef BOOL (WINAPI *SetThreadGroupAffinityFn)(HANDLE thread, const GROUP_AFFINITY *affinity, PGROUP_AFFINITY previous);
+
+//Pinning the scheduler's workers is opt-in with the environment variable VINVERSE_PIN_THREADS=1, the
+//host may place its threads itself.
+static bool pin_threads_requested() {
+    char value[8];
+    DWORD length = GetEnvironmentVariableA("VINVERSE_PIN_THREADS", value, sizeof(value));
+    return length > 0 && length < sizeof(value) && strcmp(value, "0") != 0;
+}
 
-    for (int y=0; y<height; ++y) {
-        const uint8_t *srcpp = y == 0 ? srcp+src_pitch : srcp-src_pitch;
-        const uint8_t *srcpn = y == height-1 ? srcp-src_pitch : srcp+src_pitch;
+static std::once_flag pinning_once;
+static ULONG pinning_nodes;     //0 when pinning is off or the NUMA functions are missing
+static GetNumaNodeProcessorMaskFn get_node_mask;
+static GetNumaNodeProcessorMaskExFn get_node_mask_ex;
+static SetThreadGroupAffinityFn set_group_affinity;
+
+//Binds the calling worker to the processors of one NUMA node, the slot-th in turn, so current_numa_node
+//and with it the scratch blocks the worker reuses stay on the same node for its whole life. Processor
+//groups only exist since Windows 7; before that a node mask fits the plain affinity mask.
+static void pin_current_thread(int slot) {
+    std::call_once(pinning_once, [] {
+        HMODULE kernel32 = GetModuleHandleA("kernel32.dll");
+        if (!pin_threads_requested() || kernel32 == nullptr) {
+            return;
+        }
+        auto get_highest_node = reinterpret_cast<GetNumaHighestNodeNumberFn>(GetProcAddress(kernel32, "GetNumaHighestNodeNumber"));
+        get_node_mask = reinterpret_cast<GetNumaNodeProcessorMaskFn>(GetProcAddress(kernel32, "GetNumaNodeProcessorMask"));
+        get_node_mask_ex = reinterpret_cast<GetNumaNodeProcessorMaskExFn>(GetProcAddress(kernel32, "GetNumaNodeProcessorMaskEx"));
+        set_group_affinity = reinterpret_cast<SetThreadGroupAffinityFn>(GetProcAddress(kernel32, "SetThreadGroupAffinity"));
+        ULONG highest_node;
+        if (get_highest_node != nullptr && get_highest_node(&highest_node)) {
+            pinning_nodes = highest_node + 1;
+        }
+    });
+    if (pinning_nodes == 0) {
+        return;
+    }
+    const ULONG node = ULONG(slot) % pinning_nodes;
+    if (get_node_mask_ex != nullptr && set_group_affinity != nullptr) {
+        GROUP_AFFINITY affinity = {};
+        if (get_node_mask_ex(USHORT(node), &affinity) && affinity.Mask != 0) {
+            set_group_affinity(GetCurrentThread(), &affinity, nullptr);
+        }
+        return;
+    }
+    ULONGLONG mask;
+    if (get_node_mask != nullptr && get_node_mask(UCHAR(node), &mask) && mask != 0) {
+        SetThreadAffinityMask(GetCurrentThread(), DWORD_PTR(mask));
+    }
+}
 
-        for (int x = 0; x < mod16_width; x+=16) {
-            auto p = _mm_load_si128(reinterpret_cast<const __m128i*>(srcpp+x));
-            auto c = _mm_load_si128(reinterpret_cast<const __m128i*>(srcp+x));
-            auto n = _mm_load_si128(reinterpret_cast<const __m128i*>(srcpn+x));
+struct ScratchBlock {
+    void *ptr;
+    size_t size;
+    int node;   //NUMA node of the thread that first touched it
+};
 
-            auto p_lo = _mm_unpacklo_epi8(p, zero);
-            auto p_hi = _mm_unpackhi_epi8(p, zero);
-            auto c_lo = _mm_unpacklo_epi8(c, zero);
-            auto c_hi = _mm_unpackhi_epi8(c, zero);
-            auto n_lo = _mm_unpacklo_epi8(n, zero);
-            auto n_hi = _mm_unpackhi_epi8(n, zero);
+//Process-wide pool the scratch buffers are leased from for the duration of one GetFrame call. Idle
+//instances hold nothing, so the pool grows with the number of frames processed at the same time
+//instead of with the number of instances in the script. Idle blocks are only handed to threads on the
+//node whose memory backs them; a thread on another node allocates its own rather than filtering out of
+//remote memory. A thread migrated mid-frame can still end up remote, but only for that lease.
+class ScratchArena {
+public:
+    ScratchArena() : users(0), leases(0), peak_leases(0), leased_bytes(0), peak_leased_bytes(0), allocated_bytes(0) {}
 
-            auto acc_lo = _mm_add_epi16(c_lo, p_lo);
-            auto acc_hi = _mm_add_epi16(c_hi, p_hi);
+    void add_user();
+    //idle blocks are freed when the last instance goes away
+    void remove_user();
 
-            acc_lo = _mm_add_epi16(acc_lo, c_lo);
-            acc_hi = _mm_add_epi16(acc_hi, c_hi);
+    ScratchBlock acquire(size_t size);
+    void release(const ScratchBlock &block);
 
-            acc_lo = _mm_add_epi16(acc_lo, n_lo);
-            acc_hi = _mm_add_epi16(acc_hi, n_hi);
+    const char *stats(IScriptEnvironment *env);
 
-            acc_lo = _mm_add_epi16(acc_lo, two);
-            acc_hi = _mm_add_epi16(acc_hi, two);
+private:
+    std::mutex lock;
+    std::vector<ScratchBlock> idle;
+    int users;
+    int leases;
+    int peak_leases;
+    size_t leased_bytes;
+    size_t peak_leased_bytes;
+    size_t allocated_bytes;
+};
 
-            acc_lo = _mm_srli_epi16(acc_lo, 2);
-            acc_hi = _mm_srli_epi16(acc_hi, 2);
+void ScratchArena::add_user() {
+    std::lock_guard<std::mutex> guard(lock);
+    ++users;
+}
 
-            auto dst = _mm_packus_epi16(acc_lo, acc_hi);
+void ScratchArena::remove_user() {
+    std::lock_guard<std::mutex> guard(lock);
+    if (--users > 0) {
+        return;
+    }
+    for (auto &block : idle) {
+        free_scratch(block.ptr);
+        allocated_bytes -= block.size;
+    }
+    idle.clear();
+}
 
-            _mm_store_si128(reinterpret_cast<__m128i*>(dstp+x), dst);
+ScratchBlock ScratchArena::acquire(size_t size) {
+    const int node = current_numa_node();
+    ScratchBlock block = { nullptr, 0, node };
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        //best fit, so a small clip doesn't take the block a large one needs
+        auto best = idle.end();
+        for (auto it = idle.begin(); it != idle.end(); ++it) {
+            if (it->node == node && it->size >= size && (best == idle.end() || it->size < best->size)) {
+                best = it;
+            }
         }
+        if (best != idle.end()) {
+            block = *best;
+            idle.erase(best);
+        }
+    }
 
-        srcp += src_pitch;
-        dstp += dst_pitch;
+    if (block.ptr == nullptr) {
+        block.ptr = alloc_scratch(size);
+        if (block.ptr == nullptr) {
+            return block;
+        }
+        block.size = size;
+        std::lock_guard<std::mutex> guard(lock);
+        allocated_bytes += size;
     }
+
+    std::lock_guard<std::mutex> guard(lock);
+    ++leases;
+    leased_bytes += block.size;
+    peak_leases = std::max(peak_leases, leases);
+    peak_leased_bytes = std::max(peak_leased_bytes, leased_bytes);
+    return block;
+}
+
+void ScratchArena::release(const ScratchBlock &block) {
+    std::lock_guard<std::mutex> guard(lock);
+    --leases;
+    leased_bytes -= block.size;
+    idle.push_back(block);
 }
 
+const char *ScratchArena::stats(IScriptEnvironment *env) {
+    std::lock_guard<std::mutex> guard(lock);
+    return env->Sprintf("scratch: %d leased (peak %d), %.2f MiB leased (peak %.2f MiB), %.2f MiB allocated",
+        leases, peak_leases, leased_bytes / 1048576.0, peak_leased_bytes / 1048576.0, allocated_bytes / 1048576.0);
+}
 
-static void vertical_blur5_c(uint8_t* dstp, const uint8_t *srcp, int dst_pitch, int src_pitch, int width, int height) {
-    for (int y=0; y<height; ++y) {
-        const uint8_t *srcppp = y < 2 ? srcp+src_pitch*2 : srcp-src_pitch*2;
-        const uint8_t *srcpp = y == 0 ? srcp+src_pitch : srcp-src_pitch;
-        const uint8_t *srcpn = y == height-1 ? srcp-src_pitch : srcp+src_pitch;
-        const uint8_t *srcpnn = y > height-3 ? srcp-src_pitch*2 : srcp+src_pitch*2;
+static ScratchArena scratch_arena;
 
-        for (int x=0; x<width; ++x) {
-            dstp[x] = (srcppp[x]+((srcpp[x]+srcpn[x])<<2)+srcp[x]*6+srcpnn[x]+8)>>4;
+class ScratchLease {
+public:
+    ScratchLease(ScratchArena &arena, size_t size) : arena(arena), block(arena.acquire(size)) {}
+    ~ScratchLease() {
+        if (block.ptr != nullptr) {
+            arena.release(block);
         }
+    }
 
-        srcp += src_pitch;
-        dstp += dst_pitch;
+    uint8_t *get() const { return reinterpret_cast<uint8_t*>(block.ptr); }
+
+private:
+    ScratchLease(const ScratchLease&);
+    ScratchLease &operator=(const ScratchLease&);
+
+    ScratchArena &arena;
+    ScratchBlock block;
+};
+
+static void build_dlut(int *dlut, float sstr, float scl) {
+    for (int x=-255; x<=255; ++x)
+    {
+        for (int y=-255; y<=255; ++y)
+        {
+            float y2 = y*sstr;
+            float da = fabs(float(x)) < fabs(y2) ? x : y2;
+            dlut[((x+255)<<9)+(y+255)] = float(x)*y2 < 0.0 ? int(da*scl) : int(da);
+        }
     }
 }
 
+//The 1 MiB dlut only depends on sstr and scl, so instances with the same parameters share one.
+class LutCache {
+public:
+    const int *acquire(float sstr, float scl);
+    void release(const int *dlut);
+
+    int size() {
+        std::lock_guard<std::mutex> guard(lock);
+        return int(entries.size());
+    }
+
+private:
+    struct Entry {
+        float sstr;
+        float scl;
+        int refs;
+        int *dlut;
+    };
+
+    std::mutex lock;
+    std::vector<Entry> entries;
+};
 
-static void vertical_blur5_sse2(uint8_t* dstp, const uint8_t *srcp, int dst_pitch, int src_pitch, int width, int height) {
-    int mod16_width = (width + 15) / 16 * 16;
+const int *LutCache::acquire(float sstr, float scl) {
+    std::lock_guard<std::mutex> guard(lock);
+    for (auto &entry : entries) {
+        if (entry.sstr == sstr && entry.scl == scl) {
+            ++entry.refs;
+            return entry.dlut;
+        }
+    }
 
-    auto zero = _mm_setzero_si128();
-    auto six = _mm_set1_epi16(6);
-    auto eight = _mm_set1_epi16(8);
+    Entry entry = { sstr, scl, 1, reinterpret_cast<int*>(_aligned_malloc(512 * 512 * sizeof(int), 16)) };
+    if (entry.dlut == nullptr) {
+        return nullptr;
+    }
+    build_dlut(entry.dlut, sstr, scl);
+    entries.push_back(entry);
+    return entry.dlut;
+}
 
-    for (int y=0; y<height; ++y) {
-        const uint8_t *srcppp = y < 2 ? srcp+src_pitch*2 : srcp-src_pitch*2;
-        const uint8_t *srcpp = y == 0 ? srcp+src_pitch : srcp-src_pitch;
-        const uint8_t *srcpn = y == height-1 ? srcp-src_pitch : srcp+src_pitch;
-        const uint8_t *srcpnn = y > height-3 ? srcp-src_pitch*2 : srcp+src_pitch*2;
-        
-        for (int x = 0; x < mod16_width; x+=16) {
-            auto p2 = _mm_load_si128(reinterpret_cast<const __m128i*>(srcppp+x));
-            auto p1 = _mm_load_si128(reinterpret_cast<const __m128i*>(srcpp+x));
-            auto c  = _mm_load_si128(reinterpret_cast<const __m128i*>(srcp+x));
-            auto n1 = _mm_load_si128(reinterpret_cast<const __m128i*>(srcpn+x));
-            auto n2 = _mm_load_si128(reinterpret_cast<const __m128i*>(srcpnn+x));
+void LutCache::release(const int *dlut) {
+    std::lock_guard<std::mutex> guard(lock);
+    for (auto it = entries.begin(); it != entries.end(); ++it) {
+        if (it->dlut == dlut) {
+            if (--it->refs == 0) {
+                _aligned_free(it->dlut);
+                entries.erase(it);
+            }
+            return;
+        }
+    }
+}
 
-            auto p2_lo = _mm_unpacklo_epi8(p2, zero);
-            auto p2_hi = _mm_unpackhi_epi8(p2, zero);
-            auto p1_lo = _mm_unpacklo_epi8(p1, zero);
-            auto p1_hi = _mm_unpackhi_epi8(p1, zero);
-            auto c_lo  = _mm_unpacklo_epi8(c,  zero);
-            auto c_hi  = _mm_unpackhi_epi8(c,  zero);
-            auto n1_lo = _mm_unpacklo_epi8(n1, zero);
-            auto n1_hi = _mm_unpackhi_epi8(n1, zero);
-            auto n2_lo = _mm_unpacklo_epi8(n2, zero);
-            auto n2_hi = _mm_unpackhi_epi8(n2, zero);
+static LutCache lut_cache;
 
-            auto acc_lo = _mm_mullo_epi16(c_lo, six);
-            auto acc_hi = _mm_mullo_epi16(c_hi, six);
+//Runs the background work of all instances: the built-in pool is process-wide and starts at most the
+//thread budget of workers, so many instances in one script don't each bring their own threads. An
+//embedding application can route the tasks to its own pool instead. Callers never wait for a task that
+//hasn't started, so a task stuck in a busy queue only delays work the caller ends up doing itself.
+class TaskScheduler {
+public:
+    TaskScheduler() : users(0), budget(0), idle(0), started(0), stopping(false), external(false) {}
+    //normally the last instance has stopped the workers already, this covers instances that were leaked
+    ~TaskScheduler();
 
-            auto t_lo = _mm_add_epi16(p1_lo, n1_lo);
-            auto t_hi = _mm_add_epi16(p1_hi, n1_hi);
+    void add_user();
+    //the workers are joined when the last instance goes away, long before the dll could be unloaded
+    void remove_user();
 
-            acc_lo = _mm_add_epi16(acc_lo, n2_lo);
-            acc_hi = _mm_add_epi16(acc_hi, n2_hi);
+    //a lower budget retires the surplus workers as they finish their task or wake up
+    void set_threads(int threads);
+    void set_executor(const VinverseExecutor *executor);
+    void submit(VinverseTask task, void *context);
 
-            t_lo = _mm_slli_epi16(t_lo, 2);
-            t_hi = _mm_slli_epi16(t_hi, 2);
+    //calls body(i) for every i in [0, count), on the calling thread and whatever workers pick up the
+    //helper tasks in time, and returns once all calls are done
+    void run_all(int count, const std::function<void(int)> &body);
+    //how many threads run_all can keep busy at most, the caller included
+    int concurrency();
 
-            t_lo = _mm_add_epi16(t_lo, p2_lo);
-            t_hi = _mm_add_epi16(t_hi, p2_hi);
+private:
+    struct Batch {
+        std::function<void(int)> body;
+        int count;
+        int claimed;
+        int finished;
+        std::mutex lock;
+        std::condition_variable done;
+    };
+
+    static void __cdecl run_helper(void *context);
+    static void run_batch(Batch &batch);
+    int thread_limit() const;
+    void work(int slot);
+    void stop_workers(std::unique_lock<std::mutex> &guard);
+
+    std::mutex lock;
+    std::condition_variable queued;
+    std::deque<std::pair<VinverseTask, void*> > tasks;
+    std::vector<std::thread> workers;
+    std::vector<std::thread> retired;   //workers that left after the budget was lowered, not joined yet
+    int users;
+    int budget;
+    int idle;
+    int started;    //workers ever started, their slots for pin_current_thread
+    bool stopping;
+    bool external;
+    VinverseExecutor executor;
+};
 
-            acc_lo = _mm_add_epi16(acc_lo, eight);
-            acc_hi = _mm_add_epi16(acc_hi, eight);
+void TaskScheduler::add_user() {
+    std::lock_guard<std::mutex> guard(lock);
+    ++users;
+}
 
-            acc_lo = _mm_add_epi16(acc_lo, t_lo);
-            acc_hi = _mm_add_epi16(acc_hi, t_hi);
+TaskScheduler::~TaskScheduler() {
+    std::unique_lock<std::mutex> guard(lock);
+    stop_workers(guard);
+}
 
-            acc_lo = _mm_srli_epi16(acc_lo, 4);
-            acc_hi = _mm_srli_epi16(acc_hi, 4);
+void TaskScheduler::remove_user() {
+    std::unique_lock<std::mutex> guard(lock);
+    if (--users > 0) {
+        return;
+    }
+    stop_workers(guard);
+}
 
-            auto dst = _mm_packus_epi16(acc_lo, acc_hi);
-            _mm_store_si128(reinterpret_cast<__m128i*>(dstp+x), dst);
-        }
+//the workers run the queued tasks to the end, then see stopping and return
+void TaskScheduler::stop_workers(std::unique_lock<std::mutex> &guard) {
+    std::vector<std::thread> stopped;
+    stopping = true;
+    stopped.swap(workers);
+    for (auto &worker : retired) {
+        stopped.push_back(std::move(worker));
+    }
+    retired.clear();
+    guard.unlock();
+    queued.notify_all();
+    for (auto &worker : stopped) {
+        worker.join();
+    }
+    guard.lock();
+    stopping = false;
+    idle = 0;
+}
 
-        srcp += src_pitch;
-        dstp += dst_pitch;
+void TaskScheduler::set_threads(int threads) {
+    std::vector<std::thread> finished;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        budget = std::max(threads, 0);
+        finished.swap(retired);
+    }
+    //idle workers above the new budget wake up to retire
+    queued.notify_all();
+    for (auto &worker : finished) {
+        worker.join();
     }
 }
 
-static void mt_makediff_c(uint8_t* dstp, const uint8_t *c1p, const uint8_t *c2p, int dst_pitch, int c1_pitch, int c2_pitch, int width, int height) {
-    for (int y = 0; y < height; ++y) {
-        for (int x = 0; x < width; ++x) {
-            dstp[x] = std::max(std::min(c1p[x] - c2p[x] + 128, 255), 0);
-        }
-        dstp += dst_pitch;
-        c1p += c1_pitch;
-        c2p += c2_pitch;
+int TaskScheduler::thread_limit() const {
+    return budget > 0 ? budget : std::max(int(std::thread::hardware_concurrency()), 1);
+}
+
+int TaskScheduler::concurrency() {
+    std::lock_guard<std::mutex> guard(lock);
+    return thread_limit();
+}
+
+void TaskScheduler::set_executor(const VinverseExecutor *executor) {
+    std::lock_guard<std::mutex> guard(lock);
+    external = executor != nullptr;
+    if (external) {
+        this->executor = *executor;
     }
 }
 
-static void vertical_sbr_c(uint8_t* dstp, uint8_t* tempp, const uint8_t *srcp, int dst_pitch, int temp_pitch, int src_pitch, int width, int height) {
-    vertical_blur3_c(tempp, srcp, temp_pitch, src_pitch, width, height); //temp = rg11
-    mt_makediff_c(dstp, srcp, tempp, dst_pitch, src_pitch, temp_pitch, width, height); //dst = rg11D
-    vertical_blur3_c(tempp, dstp, temp_pitch, dst_pitch, width, height); //temp = rg11D.vblur()
-    
-    for (int y = 0; y < height; ++y) {
-        for (int x = 0; x < width; ++x) {
-            int t = dstp[x]-tempp[x];
-            int t2 = dstp[x]-128;
-            if (t*t2 < 0) {
-                dstp[x] = srcp[x];
-            } else {
-                if (std::abs(t) < std::abs(t2)) {
-                    dstp[x] = srcp[x] - t;
-                } else {
-                    dstp[x] = srcp[x] - dstp[x] + 128;
+void TaskScheduler::submit(VinverseTask task, void *context) {
+    std::unique_lock<std::mutex> guard(lock);
+    if (external) {
+        const VinverseExecutor target = executor;
+        guard.unlock();
+        target.submit(target.user, task, context);
+        return;
+    }
+    tasks.push_back(std::make_pair(task, context));
+    if (idle == 0 && int(workers.size()) < thread_limit() && !stopping) {
+        workers.push_back(std::thread(&TaskScheduler::work, this, started++));
+    } else {
+        queued.notify_one();
+    }
+}
+
+void TaskScheduler::work(int slot) {
+    pin_current_thread(slot);
+    std::unique_lock<std::mutex> guard(lock);
+    for (;;) {
+        //over budget: hand our thread to the retired list and leave, the next set_threads or the last
+        //instance joins it
+        if (int(workers.size()) > thread_limit()) {
+            const auto self = std::this_thread::get_id();
+            for (auto it = workers.begin(); it != workers.end(); ++it) {
+                if (it->get_id() == self) {
+                    retired.push_back(std::move(*it));
+                    workers.erase(it);
+                    break;
                 }
             }
+            return;
         }
-        dstp += dst_pitch;
-        srcp += src_pitch;
-        tempp += temp_pitch;
+        if (tasks.empty()) {
+            if (stopping) {
+                return;
+            }
+            ++idle;
+            queued.wait(guard);
+            --idle;
+            continue;
+        }
+        auto task = tasks.front();
+        tasks.pop_front();
+        guard.unlock();
+        task.first(task.second);
+        guard.lock();
     }
 }
 
-static void mt_makediff_sse2(uint8_t* dstp, const uint8_t *c1p, const uint8_t *c2p, int dst_pitch, int c1_pitch, int c2_pitch, int width, int height) {
-    int mod16_width = (width + 15) / 16 * 16;
+void TaskScheduler::run_batch(Batch &batch) {
+    std::unique_lock<std::mutex> guard(batch.lock);
+    while (batch.claimed < batch.count) {
+        const int i = batch.claimed++;
+        guard.unlock();
+        batch.body(i);
+        guard.lock();
+        if (++batch.finished == batch.count) {
+            batch.done.notify_all();
+        }
+    }
+}
 
-    __m128i v128 = _mm_set1_epi32(0x80808080);
-    for (int y = 0; y < height; ++y) {
-        for (int x = 0; x < mod16_width; x+=16) {
-            __m128i c1 = _mm_load_si128(reinterpret_cast<const __m128i*>(c1p+x));
-            __m128i c2 = _mm_load_si128(reinterpret_cast<const __m128i*>(c2p+x));
+//the helpers own a reference, they may start after the batch has long been finished by others
+void __cdecl TaskScheduler::run_helper(void *context) {
+    std::unique_ptr<std::shared_ptr<Batch> > batch(static_cast<std::shared_ptr<Batch>*>(context));
+    run_batch(**batch);
+}
+
+void TaskScheduler::run_all(int count, const std::function<void(int)> &body) {
+    std::shared_ptr<Batch> batch(new Batch);
+    batch->body = body;
+    batch->count = count;
+    batch->claimed = 0;
+    batch->finished = 0;
+    for (int i = 1; i < count; ++i) {
+        submit(&TaskScheduler::run_helper, new std::shared_ptr<Batch>(batch));
+    }
+    run_batch(*batch);
+
+    std::unique_lock<std::mutex> guard(batch->lock);
+    while (batch->finished < count) {
+        batch->done.wait(guard);
+    }
+    //late helpers find nothing left to claim and never touch body
+    batch->body = nullptr;
+}
 
-            c1 = _mm_sub_epi8(c1, v128);
-            c2 = _mm_sub_epi8(c2, v128);
+static TaskScheduler scheduler;
 
-            __m128i diff = _mm_subs_epi8(c1, c2);
-            diff = _mm_add_epi8(diff, v128);
+//How far a source row reaches into the output: the two chained blurs of vinverse, rg11, the blur of its
+//difference and the final blur in vinverse2. Filtering part of a plane with this many extra rows above
+//and below gives the same rows as filtering the whole plane.
+static int pipeline_radius(VinverseMode mode, int radius1, int radius2) {
+    return mode == VinverseMode::Vinverse ? radius1 + radius2 : 2 * radius1 + radius2;
+}
 
-            _mm_store_si128(reinterpret_cast<__m128i*>(dstp+x), diff);
-        }
+//Addresses 4 KiB apart share an L1 set. With a pitch that is a multiple of 256 the rows a blur reads at
+//once fall into at most 16 sets, all of them for 4096, so such pitches get one extra cache line per row.
+static int scratch_pitch(int width) {
+    int pitch = (width + 15) / 16 * 16;
+    if (pitch % 256 == 0) {
+        pitch += 64;
+    }
+    return pitch;
+}
+
+//blur6_buffer starts half a page past a page boundary after blur3_buffer, so its row y doesn't share sets
+//with the rows of blur3_buffer being read to produce it, and neither does the finalize row.
+static size_t scratch_stagger(size_t pbuf_size) {
+    return (pbuf_size + 4095) / 4096 * 4096 + 2048;
+}
+
+static void copy_rows(uint8_t *dstp, const uint8_t *srcp, int dst_pitch, int src_pitch, int width, int height) {
+    for (int y = 0; y < height; ++y) {
+        memcpy(dstp, srcp, width);
         dstp += dst_pitch;
-        c1p += c1_pitch;
-        c2p += c2_pitch;
+        srcp += src_pitch;
     }
 }
 
-//mask ? a : b
-static __forceinline __m128i blend_si128(__m128i const &mask, __m128i const &desired, __m128i const &otherwise) {
-    //return _mm_blendv_ps(otherwise, desired, mask);
-    auto andop = _mm_and_si128(mask, desired);
-    auto andnop = _mm_andnot_si128(mask, otherwise);
-    return _mm_or_si128(andop, andnop);
+static void fill_rows(uint8_t *dstp, int dst_pitch, int width, int height, uint8_t value) {
+    for (int y = 0; y < height; ++y) {
+        memset(dstp, value, width);
+        dstp += dst_pitch;
+    }
 }
 
-static __forceinline __m128i abs_epi16(const __m128i &src, const __m128i &zero) {
-    __m128i is_negative = _mm_cmplt_epi16(src, zero);
-    __m128i reversed = _mm_subs_epi16(zero, src);
-    return blend_si128(is_negative, reversed, src);
+//A strip keeps strip_height rows plus the deepest stage lag (4 rows in vinverse2) of the source, both
+//intermediates and the destination in flight. On wide frames that no longer fits in L2, so the strip
+//is split into column tiles narrow enough to fit half of it. Returns 0 when no tiling is needed.
+static int select_tile_width(int width, int strip_height) {
+    size_t l2_size = get_cache_size(2);
+    if (l2_size == 0) {
+        l2_size = 256 * 1024;
+    }
+    const int rows_in_flight = (strip_height + 4) * 4;
+    int tile_width = int(l2_size / 2 / rows_in_flight) / 16 * 16;
+    tile_width = std::max(tile_width, 512);
+    return tile_width < width ? tile_width : 0;
 }
 
-static void vertical_sbr_sse2(uint8_t* dstp, uint8_t* tempp, const uint8_t *srcp, int dst_pitch, int temp_pitch, int src_pitch, int width, int height) {
-    vertical_blur3_sse2(tempp, srcp, temp_pitch, src_pitch, width, height); //temp = rg11
-    mt_makediff_sse2(dstp, srcp, tempp, dst_pitch, src_pitch, temp_pitch, width, height); //dst = rg11D
-    vertical_blur3_sse2(tempp, dstp, temp_pitch, dst_pitch, width, height); //temp = rg11D.vblur()
+//With nt=2, output planes at least this large are written with non-temporal stores: they would only push
+//the source and everything else out of the last level cache before the encoder reads them anyway. It's
+//opt-in because skipping the cache measured slower on the machines we have (8K: 46.8 ms instead of 39.5 ms).
+static size_t select_streaming_size() {
+    size_t llc_size = get_cache_size(3);
+    if (llc_size == 0) {
+        llc_size = get_cache_size(2);
+    }
+    return llc_size != 0 ? llc_size : 8 * 1024 * 1024;
+}
 
-    int mod8_width = (width + 7) / 8 * 8;
+//How planes are pushed through the pipeline: the kernel set as the cpu flags it may use, rows per strip,
+//column tile width, 0 for no tiling, and the plane size from which the output is streamed, 0 for never
+struct PipelineConfig {
+    long cpu_flags;
+    int strip_height;
+    int tile_width;
+    size_t streaming_size;
+};
 
-    __m128i zero = _mm_setzero_si128();
-    __m128i v128 = _mm_set1_epi16(128);
+static PipelineConfig default_pipeline_config(long cpu_flags, int width) {
+    PipelineConfig config = { cpu_flags, 16, select_tile_width(width, 16), 0 };
+    return config;
+}
 
-    for (int y = 0; y < height; ++y) {
-        for (int x = 0; x < mod8_width; x += 8) {
-            __m128i dst = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(dstp+x));
-            __m128i temp = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(tempp+x));
-            __m128i src = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(srcp+x));
+//Everything needed to filter planes of one geometry with one set of parameters, shared by the AviSynth
+//filter and the C interface. Processing only reads it, so one processor can run on several threads at once.
+class PlaneProcessor {
+public:
+    PlaneProcessor(VinverseMode mode, float sstr, int amnt, float scl, int radius1, int radius2, BlurTaps taps, bool stats, AuxOutput aux, int width, int height, const PipelineConfig &config);
+    ~PlaneProcessor();
+
+    //false when the dlut couldn't be allocated
+    bool is_valid() const { return !steps.uses_lut || dlut != nullptr; }
+    int alignment() const { return steps.alignment; }
+    //blur3_buffer and blur6_buffer, leased from scratch_arena for each frame
+    size_t scratch_size() const { return blur6_offset + pbuf_size; }
+    uint8_t neutral_aux() const { return aux_neutral; }
+    float sstr() const { return sstr_; }
+    float scl() const { return scl_; }
+    int amnt() const { return amnt_; }
+
+    //draft trades precision for speed, see DraftKernels
+    void process_planes(const PlaneDesc *planes, int count, FrameStats *stats, uint8_t *scratch, bool draft = false) const;
+
+    //Filters the three planes of a frame in one sweep: every step pushes a strip of chroma rows and the
+    //luma rows covering them, so each part of the frame passes through the cache once instead of once
+    //per plane. chroma_shift is from interleave_shift.
+    size_t interleaved_scratch_size(int chroma_height) const;
+    void process_interleaved(const PlaneDesc *planes, int chroma_shift, FrameStats *stats, uint8_t *scratch, bool draft = false) const;
+
+    //Pipeline of a whole plane whose source rows the caller pushes as they arrive, nullptr when out of
+    //memory. scratch stays leased until it's done; pushing more than strip_rows() at once loses the cache
+    //blocking, so larger slices should be pushed a strip at a time.
+    std::unique_ptr<PlanePipeline> make_pipeline(const PlaneDesc &plane, FrameStats *stats, uint8_t *scratch) const;
+    int strip_rows() const { return strip_height; }
 
-            dst = _mm_unpacklo_epi8(dst, zero);
-            temp = _mm_unpacklo_epi8(temp, zero);
-            src = _mm_unpacklo_epi8(src, zero);
+private:
+    PlaneProcessor(const PlaneProcessor&);
+    PlaneProcessor &operator=(const PlaneProcessor&);
 
-            __m128i t = _mm_subs_epi16(dst, temp);
-            __m128i t2 = _mm_subs_epi16(dst, v128);
+    void process_plane(const PlaneDesc &plane, const PlaneSteps &variant, FrameStats *stats, uint8_t *scratch) const;
+    void process_rows(const PlaneDesc &plane, const PlaneSteps &variant, int y_begin, int y_end, int x_begin, int x_end, FrameStats *stats, uint8_t *scratch) const;
+    void run_pipeline(const PlaneDesc &plane, const PlaneSteps &variant, const PlaneRegion &counted, FrameStats *stats, uint8_t *scratch) const;
+    PipelineParams pipeline_params(const PlaneDesc &plane, const PlaneSteps &variant, const PlaneRegion &counted, FrameStats *stats) const;
+    size_t plane_scratch_size(int height) const { return scratch_stagger(size_t(height) * pb_pitch) + size_t(height) * pb_pitch; }
+    void restore_rows(const PlaneDesc &plane, int y_begin, int y_end) const;
 
-            __m128i nochange_mask = _mm_cmplt_epi16(_mm_mullo_epi16(t, t2), zero);
+    float sstr_;
+    float scl_;
+    int amnt_;
+    int radius1;
+    int radius2;
+    BlurTaps taps;
+    int halo;
+    VinverseMode mode_;
+    uint8_t aux_neutral;
 
-            __m128i t_mask = _mm_cmplt_epi16(abs_epi16(t, zero), abs_epi16(t2, zero));
-            __m128i desired = _mm_subs_epi16(src, t);
-            __m128i otherwise = _mm_add_epi16(_mm_subs_epi16(src, dst), v128);
-            __m128i result = blend_si128(nochange_mask, src, blend_si128(t_mask, desired, otherwise));
+    const int *dlut;
 
-            result = _mm_packus_epi16(result, zero);
+    PlaneSteps steps;
+    PlaneSteps draft_steps;
 
-            _mm_storel_epi64(reinterpret_cast<__m128i*>(dstp+x), result);
-        }
-        dstp += dst_pitch;
-        srcp += src_pitch;
-        tempp += temp_pitch;
+    int pb_pitch;
+    int strip_height;
+    int tile_width;
+    size_t streaming_size;
+    size_t pbuf_size;
+    size_t blur6_offset;
+};
+
+PlaneProcessor::PlaneProcessor(VinverseMode mode, float sstr, int amnt, float scl, int radius1, int radius2, BlurTaps taps, bool stats, AuxOutput aux, int width, int height, const PipelineConfig &config)
+: sstr_(sstr), scl_(scl), amnt_(amnt), radius1(radius1), radius2(radius2), taps(taps), halo(pipeline_radius(mode, radius1, radius2)), mode_(mode), aux_neutral(aux == AuxOutput::Difference ? 128 : 0), dlut(nullptr),
+  strip_height(config.strip_height), tile_width(config.tile_width), streaming_size(config.streaming_size)
+{
+    pb_pitch = scratch_pitch(width);
+
+    steps = select_plane_steps(config.cpu_flags, mode, amnt == 255, stats, aux);
+    draft_steps = select_draft_steps(config.cpu_flags, mode, amnt == 255, stats, aux);
+
+    if (steps.uses_lut) {
+        dlut = lut_cache.acquire(sstr, scl);
     }
+
+    pbuf_size = height * pb_pitch;
+    blur6_offset = scratch_stagger(pbuf_size);
+    scratch_arena.add_user();
+    scheduler.add_user();
 }
 
-template<bool amnt_255> 
-static void finalize_plane_c(uint8_t *dstp, const uint8_t* srcp, const uint8_t *pb3, const uint8_t *pb6, const int *dlut, int dst_pitch, int src_pitch, int pb_pitch, int width, int height, int amnt) {
-    for (int y=0; y<height; ++y)
-    {
-        for (int x=0; x<width; ++x)
-        {
-            const int d1 = srcp[x]-pb3[x]+255;
-            const int d2 = pb3[x]-pb6[x]+255;
-            const int df = pb3[x]+dlut[(d1<<9)+d2];
-
-            int minm, maxm;
-            if (amnt_255) {
-                minm = 0;
-                maxm = 255;
+PlaneProcessor::~PlaneProcessor() {
+    scheduler.remove_user();
+    scratch_arena.remove_user();
+    if (dlut != nullptr) {
+        lut_cache.release(dlut);
+    }
+}
+
+//kernels are resolved at construction and alignment is checked by the caller once for the whole batch
+void PlaneProcessor::process_planes(const PlaneDesc *planes, int count, FrameStats *stats, uint8_t *scratch, bool draft) const {
+    for (int i = 0; i < count; ++i) {
+        process_plane(planes[i], draft ? draft_steps : steps, stats, scratch);
+    }
+}
+
+void PlaneProcessor::process_plane(const PlaneDesc &plane, const PlaneSteps &variant, FrameStats *stats, uint8_t *scratch) const {
+    const PlaneRegion &region = plane.region;
+    if (region.maskp == nullptr && region.x == 0 && region.y == 0 && region.width == plane.width && region.height == plane.height) {
+        run_pipeline(plane, variant, region, stats, scratch);
+        return;
+    }
+
+    //simd kernels need aligned columns, the extra ones are restored from the source with the rest
+    const int x_begin = region.x / 16 * 16;
+    const int x_end = std::min((region.x + region.width + 15) / 16 * 16, plane.width);
+    const int region_end = region.y + region.height;
+    const int right = region.x + region.width;
+
+    int restored = 0;
+    int y = region.y;
+    while (y < region_end) {
+        if (is_row_masked_out(region, y)) {
+            ++y;
+            continue;
+        }
+
+        //rows closer than two radii are merged so the extra rows of one run never overlap another run
+        int run_end = y + 1;
+        for (int gap = 0, next = run_end; next < region_end && gap < 2 * halo; ++next) {
+            if (is_row_masked_out(region, next)) {
+                ++gap;
             } else {
-                minm = std::max(srcp[x]-amnt,0);
-                maxm = std::min(srcp[x]+amnt,255);
+                run_end = next + 1;
+                gap = 0;
             }
+        }
 
-            if (df <= minm) dstp[x] = minm;
-            else if (df >= maxm) dstp[x] = maxm;
-            else dstp[x] = df;
+        process_rows(plane, variant, y, run_end, x_begin, x_end, stats, scratch);
+
+        restore_rows(plane, restored, y);
+        for (int row = y; row < run_end; ++row) {
+            //masked-out rows inside a merged run were only filtered to keep the run in one piece
+            if (is_row_masked_out(region, row)) {
+                restore_rows(plane, row, row + 1);
+                continue;
+            }
+            uint8_t *dstp = plane.dstp + row * plane.dst_pitch;
+            const uint8_t *srcp = plane.srcp + row * plane.src_pitch;
+            memcpy(dstp, srcp, region.x);
+            memcpy(dstp + right, srcp + right, plane.width - right);
+            if (plane.auxp != nullptr) {
+                uint8_t *auxp = plane.auxp + row * plane.aux_pitch;
+                memset(auxp, aux_neutral, region.x);
+                memset(auxp + right, aux_neutral, plane.width - right);
+            }
         }
-        srcp += src_pitch;
-        pb3 += pb_pitch;
-        pb6 += pb_pitch;
-        dstp += dst_pitch;
+        restored = run_end;
+        y = run_end;
     }
+    restore_rows(plane, restored, plane.height);
 }
 
-__forceinline __m128 abs_ps(const __m128 &x) {
-    static const __m128 sign_mask = _mm_set_ps1(-0.0f); // -0.f = 1 << 31
-    return _mm_andnot_ps(sign_mask, x);
+//rows left unfiltered get the source and a neutral aux plane
+void PlaneProcessor::restore_rows(const PlaneDesc &plane, int y_begin, int y_end) const {
+    copy_rows(plane.dstp + y_begin * plane.dst_pitch, plane.srcp + y_begin * plane.src_pitch, plane.dst_pitch, plane.src_pitch, plane.width, y_end - y_begin);
+    if (plane.auxp != nullptr) {
+        fill_rows(plane.auxp + y_begin * plane.aux_pitch, plane.aux_pitch, plane.width, y_end - y_begin, aux_neutral);
+    }
 }
 
-//mask ? a : b
-static __forceinline __m128 blend_ps(__m128 const &mask, __m128 const &desired, __m128 const &otherwise) {
-    //return _mm_blendv_ps(otherwise, desired, mask);
-    auto andop = _mm_and_ps(mask, desired);
-    auto andnop = _mm_andnot_ps(mask, otherwise);
-    return _mm_or_ps(andop, andnop);
+//filters rows [y_begin, y_end) of the given columns, writing up to halo rows around them as well
+void PlaneProcessor::process_rows(const PlaneDesc &plane, const PlaneSteps &variant, int y_begin, int y_end, int x_begin, int x_end, FrameStats *stats, uint8_t *scratch) const {
+    const int top = std::max(y_begin - halo, 0);
+    const int bottom = std::min(y_end + halo, plane.height);
+
+    PlaneDesc part = plane;
+    part.srcp += top * plane.src_pitch + x_begin;
+    part.dstp += top * plane.dst_pitch + x_begin;
+    if (part.auxp != nullptr) {
+        part.auxp += top * plane.aux_pitch + x_begin;
+    }
+    part.width = x_end - x_begin;
+    part.height = bottom - top;
+
+    PlaneRegion counted = plane.region;
+    counted.x -= x_begin;
+    counted.y = y_begin - top;
+    counted.height = y_end - y_begin;
+    if (counted.maskp != nullptr) {
+        counted.maskp += top * counted.mask_pitch + x_begin;
+    }
+    run_pipeline(part, variant, counted, stats, scratch);
 }
 
-static void finalize_plane_sse2(uint8_t *dstp, const uint8_t* srcp, const uint8_t *pb3, const uint8_t *pb6, float sstr, float scl, int src_pitch, int dst_pitch, int pb_pitch, int width, int height, int amnt) {
-    int mod8_width = (width+7) / 8 * 8;
+PipelineParams PlaneProcessor::pipeline_params(const PlaneDesc &plane, const PlaneSteps &variant, const PlaneRegion &counted, FrameStats *stats) const {
+    PipelineParams params;
+    params.mode = mode_;
+    const bool streaming = streaming_size != 0 && size_t(plane.width) * plane.height >= streaming_size;
+    if (streaming) {
+        params.step = plane.luma ? variant.luma_streaming : variant.chroma_streaming;
+    } else {
+        params.step = plane.luma ? variant.luma : variant.chroma;
+    }
+    params.sstr = sstr_;
+    params.scl = scl_;
+    params.amnt = amnt_;
+    params.dlut = dlut;
+    params.tile_width = tile_width;
+    params.radius1 = radius1;
+    params.radius2 = radius2;
+    params.taps = taps;
+    params.stats = stats;
+    params.counted = counted;
+    return params;
+}
 
-    auto zero = _mm_setzero_si128();
-    auto sstr_vector = _mm_set_ps1(sstr);
-    auto scl_vector = _mm_set_ps1(scl);
-    auto amnt_vector = _mm_set1_epi16(amnt);
+void PlaneProcessor::run_pipeline(const PlaneDesc &plane, const PlaneSteps &variant, const PlaneRegion &counted, FrameStats *stats, uint8_t *scratch) const {
+    //the whole frame is already there, but feeding it in strips keeps the rows each stage
+    //produces in cache until the next stage consumes them
+    PlanePipeline pipeline(pipeline_params(plane, variant, counted, stats), plane, scratch, scratch + blur6_offset, pb_pitch);
+    while (pipeline.finished_rows() < plane.height) {
+        pipeline.push_rows(strip_height);
+    }
+}
 
-    for (int y = 0; y < height; ++y)
-    {
-        for (int x = 0; x < mod8_width; x+=8)
-        {
-            __m128i b3 = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(pb3 + x));
-            __m128i b6 = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(pb6 + x));
-            __m128i src = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(srcp + x));
+std::unique_ptr<PlanePipeline> PlaneProcessor::make_pipeline(const PlaneDesc &plane, FrameStats *stats, uint8_t *scratch) const {
+    return std::unique_ptr<PlanePipeline>(new (std::nothrow) PlanePipeline(pipeline_params(plane, steps, plane.region, stats), plane, scratch, scratch + blur6_offset, pb_pitch));
+}
+
+//luma gets the single plane layout, the chroma planes follow with the same layout for their height
+size_t PlaneProcessor::interleaved_scratch_size(int chroma_height) const {
+    return scratch_stagger(scratch_size()) + scratch_stagger(plane_scratch_size(chroma_height)) + plane_scratch_size(chroma_height);
+}
+
+void PlaneProcessor::process_interleaved(const PlaneDesc *planes, int chroma_shift, FrameStats *stats, uint8_t *scratch, bool draft) const {
+    const PlaneSteps &variant = draft ? draft_steps : steps;
+    const size_t plane_offsets[3] = {
+        0,
+        scratch_stagger(scratch_size()),
+        scratch_stagger(scratch_size()) + scratch_stagger(plane_scratch_size(planes[1].height))
+    };
+
+    std::unique_ptr<PlanePipeline> pipelines[3];
+    for (int i = 0; i < 3; ++i) {
+        uint8_t *base = scratch + plane_offsets[i];
+        const size_t blur6 = scratch_stagger(size_t(planes[i].height) * pb_pitch);
+        pipelines[i].reset(new PlanePipeline(pipeline_params(planes[i], variant, planes[i].region, stats), planes[i], base, base + blur6, pb_pitch));
+    }
+
+    //luma strips are taller by the subsampling, so the three pipelines stay on the same part of the frame
+    bool finished = false;
+    while (!finished) {
+        finished = true;
+        for (int i = 0; i < 3; ++i) {
+            if (pipelines[i]->finished_rows() < planes[i].height) {
+                pipelines[i]->push_rows(i == 0 ? strip_height << chroma_shift : strip_height);
+                finished = false;
+            }
+        }
+    }
+}
+
+//Vertical chroma subsampling as a shift when luma and two chroma planes can go through process_interleaved,
+//-1 when they can't. Regions and masks make the planes skip rows on their own, so only whole planes qualify.
+static int interleave_shift(const PlaneDesc *planes, int count) {
+    if (count != 3 || !planes[0].luma || planes[1].width != planes[2].width || planes[1].height != planes[2].height) {
+        return -1;
+    }
+    for (int i = 0; i < 3; ++i) {
+        const PlaneRegion &region = planes[i].region;
+        if (region.maskp != nullptr || region.x != 0 || region.y != 0 || region.width != planes[i].width || region.height != planes[i].height) {
+            return -1;
+        }
+    }
+    for (int shift = 0; shift <= 1; ++shift) {
+        if (planes[1].height << shift == planes[0].height) {
+            return shift;
+        }
+    }
+    return -1;
+}
+
+//same convention as Crop: non-positive w and h are relative to the right and bottom edges
+static bool resolve_region(int x, int y, int w, int h, int width, int height, PlaneRegion &region) {
+    region.x = x;
+    region.y = y;
+    region.width = w > 0 ? w : width - x + w;
+    region.height = h > 0 ? h : height - y + h;
+    region.maskp = nullptr;
+    region.mask_pitch = 0;
+    return x >= 0 && y >= 0 && region.width > 0 && region.height > 0 && x + region.width <= width && y + region.height <= height;
+}
+
+static std::string cpu_brand() {
+    int info[4];
+    __cpuid(info, 0x80000000);
+    if (unsigned(info[0]) < 0x80000004u) {
+        return "unknown";
+    }
+    char brand[49] = {};
+    for (int i = 0; i < 3; ++i) {
+        __cpuid(info, 0x80000002 + i);
+        memcpy(brand + i * 16, info, 16);
+    }
+    std::string name(brand);
+    name.erase(0, name.find_first_not_of(' '));
+    return name;
+}
+
+//Flags of the kernel tiers from cpuid, for callers of the C interface and for AVX2 under AviSynth 2.6
+static long detect_cpu_flags() {
+    int info[4];
+    __cpuid(info, 0);
+    const int max_leaf = info[0];
+    __cpuid(info, 1);
+    long flags = 0;
+    if (info[3] & (1 << 26)) {
+        flags |= CPUF_SSE2;
+    }
+    if (info[2] & (1 << 9)) {
+        flags |= CPUF_SSSE3;
+    }
+    if (info[2] & (1 << 19)) {
+        flags |= CPUF_SSE4_1;
+    }
+    //AVX2 also needs the OS to save the ymm registers: OSXSAVE, AVX and the xmm and ymm state in XCR0
+    const bool ymm_state = (info[2] & (1 << 27)) && (info[2] & (1 << 28)) && (_xgetbv(0) & 6) == 6;
+    if (ymm_state && max_leaf >= 7) {
+        __cpuidex(info, 7, 0);
+        if (info[1] & (1 << 5)) {
+            flags |= CPUF_AVX2;
+        }
+    }
+    return flags;
+}
+
+//Tuned configurations are kept in %LOCALAPPDATA%\vinverse\tuning.txt, one line per cpu model and geometry
+//with the newest entry winning, so calibration runs once per host instead of on every script load.
+class TuningCache {
+public:
+    bool lookup(const std::string &key, PipelineConfig &config);
+    void store(const std::string &key, const PipelineConfig &config);
+
+private:
+    //far above the tuned heights of 8 to 64 rows
+    enum { max_strip_height = 1024 };
+
+    static std::string path(bool create_directory);
+
+    std::mutex lock;
+};
 
-            b3  = _mm_unpacklo_epi8(b3, zero);
-            b6  = _mm_unpacklo_epi8(b6, zero);
-            src = _mm_unpacklo_epi8(src, zero);
+std::string TuningCache::path(bool create_directory) {
+    char base[MAX_PATH];
+    DWORD length = GetEnvironmentVariableA("LOCALAPPDATA", base, MAX_PATH);
+    if (length == 0 || length >= MAX_PATH) {
+        return std::string();
+    }
+    std::string directory = std::string(base) + "\\vinverse";
+    if (create_directory) {
+        CreateDirectoryA(directory.c_str(), nullptr);
+    }
+    return directory + "\\tuning.txt";
+}
 
-            auto d1i = _mm_subs_epi16(src, b3);
-            auto d1i_sign = _mm_cmplt_epi16(d1i, zero);
+bool TuningCache::lookup(const std::string &key, PipelineConfig &config) {
+    std::lock_guard<std::mutex> guard(lock);
+    const std::string file_name = path(false);
+    FILE *file = file_name.empty() ? nullptr : fopen(file_name.c_str(), "r");
+    if (file == nullptr) {
+        return false;
+    }
+    bool found = false;
+    char line[512];
+    while (fgets(line, sizeof(line), file) != nullptr) {
+        //key, then cpu flags, strip height and tile width
+        char *values = line + strlen(line);
+        for (int tabs = 0; values > line && tabs < 3; ) {
+            if (*--values == '\t') {
+                ++tabs;
+            }
+        }
+        if (values == line || key.compare(0, std::string::npos, line, values - line) != 0) {
+            continue;
+        }
+        //the file can be edited by hand: tiles have to start on aligned columns and a huge strip height
+        //would size the scratch buffers with it
+        PipelineConfig entry;
+        entry.streaming_size = 0;
+        if (sscanf(values, "\t%ld\t%d\t%d", &entry.cpu_flags, &entry.strip_height, &entry.tile_width) == 3
+            && entry.strip_height > 0 && entry.strip_height <= max_strip_height && entry.tile_width >= 0 && entry.tile_width % 16 == 0) {
+            config = entry;
+            found = true;
+        }
+    }
+    fclose(file);
+    return found;
+}
 
-            auto d2i = _mm_subs_epi16(b3, b6);
-            auto d2i_sign = _mm_cmplt_epi16(d2i, zero);
+void TuningCache::store(const std::string &key, const PipelineConfig &config) {
+    std::lock_guard<std::mutex> guard(lock);
+    const std::string file_name = path(true);
+    FILE *file = file_name.empty() ? nullptr : fopen(file_name.c_str(), "a");
+    if (file == nullptr) {
+        return;
+    }
+    fprintf(file, "%s\t%ld\t%d\t%d\n", key.c_str(), config.cpu_flags, config.strip_height, config.tile_width);
+    fclose(file);
+}
 
-            auto d1_lo = _mm_cvtepi32_ps(_mm_unpacklo_epi16(d1i, d1i_sign));
-            auto d1_hi = _mm_cvtepi32_ps(_mm_unpackhi_epi16(d1i, d1i_sign));
+static TuningCache tuning_cache;
+
+//Times the candidate kernel sets, strip heights and tile widths on a synthetic luma plane of the clip's
+//geometry and returns the fastest. Each candidate gets a warm-up run and keeps its best of three.
+static PipelineConfig tune_pipeline(VinverseMode mode, float sstr, int amnt, float scl, int radius1, int radius2, BlurTaps taps, int width, int height, long cpu_flags) {
+    //every tier the cpu has, the widest isn't always the fastest on narrow planes
+    static const long tier_flags[] = {
+        CPUF_SSE2 | CPUF_SSSE3 | CPUF_SSE4_1 | CPUF_AVX2,
+        CPUF_SSE2 | CPUF_SSSE3 | CPUF_SSE4_1,
+        CPUF_SSE2 | CPUF_SSSE3,
+        CPUF_SSE2,
+        0
+    };
+    std::vector<long> kernel_sets;
+    for (auto flags : tier_flags) {
+        if ((cpu_flags & flags) == flags) {
+            kernel_sets.push_back(flags);
+        }
+    }
+    static const int strip_heights[] = { 8, 16, 32, 64 };
 
-            auto d2_lo = _mm_cvtepi32_ps(_mm_unpacklo_epi16(d2i, d2i_sign));
-            auto d2_hi = _mm_cvtepi32_ps(_mm_unpackhi_epi16(d2i, d2i_sign));
+    const int pitch = (width + 15) / 16 * 16;
+    uint8_t *srcp = reinterpret_cast<uint8_t*>(_aligned_malloc(size_t(pitch) * height * 2, 16));
+    PipelineConfig best = default_pipeline_config(cpu_flags, width);
+    if (srcp == nullptr) {
+        return best;
+    }
+    uint8_t *dstp = srcp + size_t(pitch) * height;
+    //noise on alternating rows, roughly what combed material looks like to the blurs
+    uint32_t seed = 12345;
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < pitch; ++x) {
+            seed = seed * 1103515245 + 12345;
+            srcp[y * pitch + x] = uint8_t((y & 1 ? 96 : 160) + (seed >> 26));
+        }
+    }
 
-            auto t_lo = _mm_mul_ps(d2_lo, sstr_vector);
-            auto t_hi = _mm_mul_ps(d2_hi, sstr_vector);
+    PlaneDesc plane;
+    plane.dstp = dstp;
+    plane.srcp = srcp;
+    plane.dst_pitch = pitch;
+    plane.src_pitch = pitch;
+    plane.width = width;
+    plane.height = height;
+    plane.luma = true;
+    plane.auxp = nullptr;
+    plane.aux_pitch = 0;
+    resolve_region(0, 0, 0, 0, width, height, plane.region);
+
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+    LONGLONG best_time = -1;
+
+    for (auto kernels : kernel_sets) {
+        for (auto strip_height : strip_heights) {
+            const int auto_tile = select_tile_width(width, strip_height);
+            const int tile_widths[] = { 0, auto_tile, auto_tile / 2 / 16 * 16 };
+            for (int t = 0; t < 3; ++t) {
+                if ((t > 0 && tile_widths[t] == 0) || (t == 2 && tile_widths[2] == tile_widths[1])) {
+                    continue;
+                }
+                PipelineConfig config = { kernels, strip_height, tile_widths[t], best.streaming_size };
+                PlaneProcessor processor(mode, sstr, amnt, scl, radius1, radius2, taps, false, AuxOutput::None, width, height, config);
+                ScratchLease scratch(scratch_arena, processor.scratch_size());
+                if (!processor.is_valid() || scratch.get() == nullptr) {
+                    continue;
+                }
+                processor.process_planes(&plane, 1, nullptr, scratch.get());
+
+                LONGLONG time = -1;
+                for (int run = 0; run < 3; ++run) {
+                    LARGE_INTEGER start, end;
+                    QueryPerformanceCounter(&start);
+                    processor.process_planes(&plane, 1, nullptr, scratch.get());
+                    QueryPerformanceCounter(&end);
+                    if (time < 0 || end.QuadPart - start.QuadPart < time) {
+                        time = end.QuadPart - start.QuadPart;
+                    }
+                }
+                if (best_time < 0 || time < best_time) {
+                    best_time = time;
+                    best = config;
+                }
+            }
+        }
+    }
 
-            auto da_mask_lo = _mm_cmplt_ps(abs_ps(d1_lo), abs_ps(t_lo));
-            auto da_mask_hi = _mm_cmplt_ps(abs_ps(d1_hi), abs_ps(t_hi));
-            
-            auto da_lo = blend_ps(da_mask_lo, d1_lo, t_lo);
-            auto da_hi = blend_ps(da_mask_hi, d1_hi, t_hi);
+    _aligned_free(srcp);
+    return best;
+}
 
-            auto desired_lo = _mm_mul_ps(da_lo, scl_vector);
-            auto desired_hi = _mm_mul_ps(da_hi, scl_vector);
+static PipelineConfig tuned_pipeline_config(VinverseMode mode, float sstr, int amnt, float scl, int radius1, int radius2, BlurTaps taps, int width, int height, long cpu_flags) {
+    //the thread budget decides how many planes and frames compete for the caches, so a change retunes
+    char geometry[96];
+    sprintf(geometry, "\t%s\t%d,%d,%s\t%dx%d\t%d threads", mode == VinverseMode::Vinverse ? "vinverse" : "vinverse2", radius1, radius2, taps == BlurTaps::Flat ? "flat" : "binomial", width, height,
+        scheduler.concurrency());
+    const std::string key = cpu_brand() + geometry;
+
+    PipelineConfig config;
+    if (tuning_cache.lookup(key, config)) {
+        //a file copied from another machine may name kernels this one lacks
+        config.cpu_flags &= cpu_flags;
+        return config;
+    }
+    config = tune_pipeline(mode, sstr, amnt, scl, radius1, radius2, taps, width, height, cpu_flags);
+    tuning_cache.store(key, config);
+    return config;
+}
 
-            auto fin_mask_lo = _mm_cmplt_ps(_mm_mul_ps(d1_lo, t_lo), _mm_castsi128_ps(zero));
-            auto fin_mask_hi = _mm_cmplt_ps(_mm_mul_ps(d1_hi, t_hi), _mm_castsi128_ps(zero));
+//A frame with its source fetched and its output allocated, ready to be filtered on any thread. Only the
+//thread the host calls GetFrame on touches the frames themselves, workers just see the plane pointers.
+struct FrameJob {
+    int n;
+    const PlaneProcessor *processor;
+    PVideoFrame src;
+    PVideoFrame dst;
+    PVideoFrame mask;
+    PlaneDesc descs[3];
+    int count;
+    FrameStats stats;
+    bool draft;
+    bool parallel;  //planes as separate tasks on the scheduler
+    bool interleaved;  //all planes in one sweep where the layout allows it
+    bool filtered;  //false when no scratch could be leased
+};
 
-            auto add_lo = _mm_cvttps_epi32(blend_ps(fin_mask_lo, desired_lo, da_lo));
-            auto add_hi = _mm_cvttps_epi32(blend_ps(fin_mask_hi, desired_hi, da_hi));
+static void filter_job(FrameJob &job) {
+    job.stats.change = job.stats.clamped = job.stats.scaled = 0;
+    const int chroma_shift = job.interleaved && !job.parallel ? interleave_shift(job.descs, job.count) : -1;
+    if (chroma_shift >= 0) {
+        ScratchLease scratch(scratch_arena, job.processor->interleaved_scratch_size(job.descs[1].height));
+        job.filtered = scratch.get() != nullptr;
+        if (job.filtered) {
+            job.processor->process_interleaved(job.descs, chroma_shift, &job.stats, scratch.get(), job.draft);
+        }
+        return;
+    }
+    if (!job.parallel || job.count < 2) {
+        ScratchLease scratch(scratch_arena, job.processor->scratch_size());
+        job.filtered = scratch.get() != nullptr;
+        if (job.filtered) {
+            job.processor->process_planes(job.descs, job.count, &job.stats, scratch.get(), job.draft);
+        }
+        return;
+    }
 
-            auto add = _mm_packs_epi32(add_lo, add_hi);
-            auto df = _mm_add_epi16(b3, add);
+    //every plane needs its own scratch and totals
+    FrameStats plane_stats[3] = {};
+    bool filtered[3] = {};
+    scheduler.run_all(job.count, [&](int i) {
+        ScratchLease scratch(scratch_arena, job.processor->scratch_size());
+        filtered[i] = scratch.get() != nullptr;
+        if (filtered[i]) {
+            job.processor->process_planes(&job.descs[i], 1, &plane_stats[i], scratch.get(), job.draft);
+        }
+    });
+    job.filtered = true;
+    for (int i = 0; i < job.count; ++i) {
+        job.filtered = job.filtered && filtered[i];
+        job.stats.change += plane_stats[i].change;
+        job.stats.clamped += plane_stats[i].clamped;
+        job.stats.scaled += plane_stats[i].scaled;
+    }
+}
 
-            auto minm = _mm_subs_epi16(src, amnt_vector);
-            auto maxf = _mm_adds_epi16(src, amnt_vector);
+//Filters the frames after the last requested one on the scheduler while the host works on that one,
+//for hosts that request frames one at a time from a single thread. Frames outside the window after the
+//last request are dropped, so a seek discards everything; running ones are waited for first because
+//their frames may only be released on the host's thread.
+class FramePrefetcher {
+public:
+    explicit FramePrefetcher(int depth);
+    ~FramePrefetcher();
 
-            df = _mm_max_epi16(df, minm);
-            df = _mm_min_epi16(df, maxf);
+    //moves the job for frame n into job, waiting for it to finish, and drops the ones outside the new
+    //window; false if n wasn't prefetched
+    bool take(int n, FrameJob &job);
+    //frames of the window after n that still have to be scheduled
+    std::vector<int> missing(int n, int num_frames);
+    void schedule(std::unique_ptr<FrameJob> job);
 
-            auto result = _mm_packus_epi16(df, zero);
-            _mm_storel_epi64(reinterpret_cast<__m128i*>(dstp+x), result);
+private:
+    FramePrefetcher(const FramePrefetcher&);
+    FramePrefetcher &operator=(const FramePrefetcher&);
+
+    enum JobState { QUEUED, RUNNING, DONE };
+    struct Entry {
+        std::unique_ptr<FrameJob> job;
+        JobState state;
+    };
+
+    //shared with the submitted tasks, which can outlive the prefetcher in an external executor's queue
+    struct Queue {
+        Queue() : stopping(false) {}
+
+        std::mutex lock;
+        std::condition_variable finished;
+        std::vector<Entry*> entries;
+        bool stopping;
+    };
+
+    //each task filters whichever job is queued first, not necessarily the one it was submitted for
+    static void __cdecl run_task(void *context);
+    void retain(int n, std::unique_lock<std::mutex> &guard);
+
+    int depth;
+    std::shared_ptr<Queue> queue;
+};
+
+FramePrefetcher::FramePrefetcher(int depth) : depth(depth), queue(new Queue) {}
+
+FramePrefetcher::~FramePrefetcher() {
+    std::unique_lock<std::mutex> guard(queue->lock);
+    queue->stopping = true;
+    for (auto entry : queue->entries) {
+        while (entry->state == RUNNING) {
+            queue->finished.wait(guard);
         }
-        srcp += src_pitch;
-        pb3 += pb_pitch;
-        pb6 += pb_pitch;
-        dstp += dst_pitch;
     }
+    for (auto entry : queue->entries) {
+        delete entry;
+    }
+    queue->entries.clear();
 }
 
-enum class VinverseMode {
-    Vinverse,
-    Vinverse2
+void __cdecl FramePrefetcher::run_task(void *context) {
+    std::unique_ptr<std::shared_ptr<Queue> > owner(static_cast<std::shared_ptr<Queue>*>(context));
+    Queue &queue = **owner;
+    std::unique_lock<std::mutex> guard(queue.lock);
+    if (queue.stopping) {
+        return;
+    }
+    Entry *next = nullptr;
+    for (auto entry : queue.entries) {
+        if (entry->state == QUEUED) {
+            next = entry;
+            break;
+        }
+    }
+    if (next == nullptr) {
+        return;
+    }
+    next->state = RUNNING;
+    guard.unlock();
+    filter_job(*next->job);
+    guard.lock();
+    next->state = DONE;
+    queue.finished.notify_all();
+}
+
+void FramePrefetcher::retain(int n, std::unique_lock<std::mutex> &guard) {
+    auto &entries = queue->entries;
+    for (size_t i = 0; i < entries.size(); ) {
+        Entry *entry = entries[i];
+        if (entry->job->n > n && entry->job->n <= n + depth) {
+            ++i;
+            continue;
+        }
+        while (entry->state == RUNNING) {
+            queue->finished.wait(guard);
+        }
+        //the entries may have changed while waiting
+        entries.erase(std::find(entries.begin(), entries.end(), entry));
+        delete entry;
+        i = 0;
+    }
+}
+
+bool FramePrefetcher::take(int n, FrameJob &job) {
+    std::unique_lock<std::mutex> guard(queue->lock);
+    Entry *found = nullptr;
+    for (auto entry : queue->entries) {
+        if (entry->job->n == n) {
+            found = entry;
+        }
+    }
+    if (found != nullptr) {
+        while (found->state != DONE) {
+            if (found->state == QUEUED) {
+                //not picked up yet, cheaper to run it right here than to wait for a worker
+                found->state = RUNNING;
+                guard.unlock();
+                filter_job(*found->job);
+                guard.lock();
+                found->state = DONE;
+                queue->finished.notify_all();
+            } else {
+                queue->finished.wait(guard);
+            }
+        }
+        job = *found->job;
+    }
+    retain(n, guard);
+    return found != nullptr;
+}
+
+std::vector<int> FramePrefetcher::missing(int n, int num_frames) {
+    std::lock_guard<std::mutex> guard(queue->lock);
+    std::vector<int> frames;
+    for (int i = n + 1; i <= n + depth && i < num_frames; ++i) {
+        bool present = false;
+        for (auto entry : queue->entries) {
+            present = present || entry->job->n == i;
+        }
+        if (!present) {
+            frames.push_back(i);
+        }
+    }
+    return frames;
+}
+
+void FramePrefetcher::schedule(std::unique_ptr<FrameJob> job) {
+    Entry *entry = new Entry;
+    entry->job = std::move(job);
+    entry->state = QUEUED;
+    {
+        std::lock_guard<std::mutex> guard(queue->lock);
+        queue->entries.push_back(entry);
+    }
+    scheduler.submit(&FramePrefetcher::run_task, new std::shared_ptr<Queue>(queue));
+}
+
+//Frames first to last, inclusive, are filtered with the parameters of processors[processor]
+struct FrameRangeParams {
+    int first;
+    int last;
+    int processor;
 };
 
+//How much of a frame gets filtered: everything, luma only with the draft kernels, or nothing
+enum class FrameQuality {
+    Full,
+    Draft,
+    Passthrough
+};
+
+//Picks the quality for each frame from the time left until its deadline. The cost of each quality is a
+//moving average of its last runs; the estimates of the ones not picked decay, so a quality dropped after
+//a slow frame is tried again once the host catches up.
+class DeadlineGovernor {
+public:
+    DeadlineGovernor(double deadline_ms, FrameQuality preferred);
+
+    LONGLONG now() const;
+    FrameQuality select(LONGLONG start);
+    void update(FrameQuality quality, LONGLONG start);
+
+    int drafted;
+    int skipped;
+    int late;
+
+private:
+    LONGLONG deadline;
+    FrameQuality preferred;
+    double cost[3];
+};
+
+DeadlineGovernor::DeadlineGovernor(double deadline_ms, FrameQuality preferred) : drafted(0), skipped(0), late(0), preferred(preferred) {
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+    deadline = LONGLONG(deadline_ms * frequency.QuadPart / 1000.0);
+    cost[0] = cost[1] = cost[2] = 0.0;
+}
+
+LONGLONG DeadlineGovernor::now() const {
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return now.QuadPart;
+}
+
+FrameQuality DeadlineGovernor::select(LONGLONG start) {
+    const double remaining = double(deadline - (now() - start));
+    FrameQuality quality = FrameQuality::Passthrough;
+    if (preferred == FrameQuality::Full && cost[int(FrameQuality::Full)] <= remaining) {
+        quality = FrameQuality::Full;
+    } else if (cost[int(FrameQuality::Draft)] <= remaining) {
+        quality = FrameQuality::Draft;
+    }
+    if (quality != preferred) {
+        ++(quality == FrameQuality::Draft ? drafted : skipped);
+    }
+    return quality;
+}
+
+void DeadlineGovernor::update(FrameQuality quality, LONGLONG start) {
+    const LONGLONG end = now();
+    const double elapsed = double(end - start);
+    const bool missed = end - start > deadline;
+    for (int q = 0; q < 3; ++q) {
+        if (q == int(quality)) {
+            //a miss takes full effect, otherwise one slow frame would be retried a few frames later
+            cost[q] = cost[q] == 0.0 || missed ? std::max(cost[q], elapsed) : cost[q] * 0.75 + elapsed * 0.25;
+        } else {
+            cost[q] *= 0.95;
+        }
+    }
+    if (missed) {
+        ++late;
+    }
+}
+
 class Vinverse : public GenericVideoFilter {
 public:
-    Vinverse(PClip child, float sstr, int amnt, int uv, float scl, VinverseMode mode, IScriptEnvironment *env);
+    Vinverse(PClip child, float sstr, int amnt, int uv, float scl, int radius1, int radius2, int taps, int x, int y, int w, int h, PClip mask, bool stats, int aux, bool tune, int nt, int prefetch,
+             bool draft, float deadline, const char *params, bool mt, bool interleave, VinverseMode mode, IScriptEnvironment *env);
     PVideoFrame __stdcall GetFrame(int n, IScriptEnvironment *env);
-    ~Vinverse();
 
 private:
-    float sstr_;
-    float scl_;
-    int amnt_;
-    int uv_;
-    VinverseMode mode_;
-
-    uint8_t *blur3_buffer, *blur6_buffer;
-    int *dlut;
+    const PlaneProcessor *processor_for(int n) const;
+    void fetch_frame(int n, FrameJob &job, IScriptEnvironment *env);
+    void describe_planes(FrameJob &job, FrameQuality quality, IScriptEnvironment *env);
+    PVideoFrame finish_frame(FrameJob &job, IScriptEnvironment *env);
 
-    int pb_pitch;
-    uint8_t* buffer;
+    int uv_;
+    PClip mask_;
+    PlaneRegion roi;
+    bool stats_;
+    AuxOutput aux_;
+    FrameQuality quality_;
+    bool mt_;
+    bool interleave_;
+
+    //one per parameter set, the first one has the filter's arguments
+    std::vector<std::unique_ptr<PlaneProcessor> > processors;
+    std::vector<FrameRangeParams> ranges;
+    //only with prefetch, declared after the processors so it's stopped first
+    std::unique_ptr<FramePrefetcher> prefetcher;
+    std::mutex request_lock;
+    //only with a deadline
+    std::unique_ptr<DeadlineGovernor> governor;
+    std::mutex governor_lock;
 };
 
-
-Vinverse::Vinverse(PClip child, float sstr, int amnt, int uv, float scl, VinverseMode mode, IScriptEnvironment *env)
-: GenericVideoFilter(child), sstr_(sstr), amnt_(amnt), uv_(uv), scl_(scl), mode_(mode), blur3_buffer(nullptr), blur6_buffer(nullptr), dlut(nullptr)
+Vinverse::Vinverse(PClip child, float sstr, int amnt, int uv, float scl, int radius1, int radius2, int taps, int x, int y, int w, int h, PClip mask, bool stats, int aux, bool tune, int nt, int prefetch,
+                   bool draft, float deadline, const char *params, bool mt, bool interleave, VinverseMode mode, IScriptEnvironment *env)
+: GenericVideoFilter(child), uv_(uv), mask_(mask), stats_(stats), aux_(AuxOutput(aux)), quality_(draft ? FrameQuality::Draft : FrameQuality::Full), mt_(mt), interleave_(interleave)
 {
     if (!vi.IsPlanar()) {
         env->ThrowError("Vinverse: only planar input is supported!");
@@ -419,52 +1578,135 @@ Vinverse::Vinverse(PClip child, float sstr, int amnt, int uv, float scl, Vinvers
     if (uv < 1 || uv > 3) {
         env->ThrowError("Vinverse: uv must be set to 1, 2, or 3!");
     }
+    if (aux < 0 || aux > 2) {
+        env->ThrowError("Vinverse: aux must be set to 0, 1, or 2!");
+    }
+    if (radius1 < 1 || radius1 > 3 || radius2 < 1 || radius2 > 3) {
+        env->ThrowError("Vinverse: r1 and r2 must be between 1 and 3!");
+    }
+    if (taps < 0 || taps > 1) {
+        env->ThrowError("Vinverse: taps must be set to 0 or 1!");
+    }
+    if (nt < 0 || nt > 2) {
+        env->ThrowError("Vinverse: nt must be set to 0, 1, or 2!");
+    }
+    if (prefetch < 0 || prefetch > 16) {
+        env->ThrowError("Vinverse: prefetch must be between 0 and 16!");
+    }
+    if (deadline < 0) {
+        env->ThrowError("Vinverse: deadline must not be negative!");
+    }
+    //prefetched frames are filtered before they are requested, there's nothing to time them against
+    if (deadline > 0 && prefetch > 0) {
+        env->ThrowError("Vinverse: deadline and prefetch can't be used together!");
+    }
 
-    pb_pitch = (vi.width+15) / 16 * 16;
-
-#pragma warning(disable: 4800)
-    bool sse2 = false;// env->GetCPUFlags() & CPUF_SSE2;
-#pragma warning(default: 4800)
-
-    size_t pbuf_size = vi.height * pb_pitch;
-    size_t dlut_size = sse2 ? 0 : 512 * 512 * sizeof(int);
+    if (!resolve_region(x, y, w, h, vi.width, vi.height, roi)) {
+        env->ThrowError("Vinverse: the region must lie within the frame!");
+    }
+    if (mask_) {
+        const VideoInfo &mask_vi = mask_->GetVideoInfo();
+        if (!mask_vi.IsSameColorspace(vi) || mask_vi.width != vi.width || mask_vi.height != vi.height) {
+            env->ThrowError("Vinverse: mask must have the same colorspace and dimensions as the clip!");
+        }
+    }
 
-    buffer = reinterpret_cast<uint8_t*>(_aligned_malloc(pbuf_size*2 + dlut_size, 16));
+    const long cpu_flags = env->GetCPUFlags() | (detect_cpu_flags() & CPUF_AVX2);
+    PipelineConfig config = tune ? tuned_pipeline_config(mode, sstr, amnt, scl, radius1, radius2, BlurTaps(taps), vi.width, vi.height, cpu_flags) : default_pipeline_config(cpu_flags, vi.width);
+    if (nt == 1) {
+        config.streaming_size = 1;
+    } else if (nt == 2) {
+        config.streaming_size = select_streaming_size();
+    }
+    //identical parameter sets share a processor, and processors with the same sstr and scl share a lut
+    auto add_processor = [&](float set_sstr, int set_amnt, float set_scl) -> int {
+        for (size_t i = 0; i < processors.size(); ++i) {
+            const PlaneProcessor &existing = *processors[i];
+            if (existing.sstr() == set_sstr && existing.amnt() == set_amnt && existing.scl() == set_scl) {
+                return int(i);
+            }
+        }
+        processors.push_back(std::unique_ptr<PlaneProcessor>(new PlaneProcessor(mode, set_sstr, set_amnt, set_scl, radius1, radius2, BlurTaps(taps), stats, aux_, vi.width, vi.height, config)));
+        if (!processors.back()->is_valid()) {
+            env->ThrowError("Vinverse:  malloc failure!");
+        }
+        return int(processors.size()) - 1;
+    };
+    add_processor(sstr, amnt, scl);
+
+    if (params != nullptr && params[0] != '\0') {
+        FILE *file = fopen(params, "r");
+        if (file == nullptr) {
+            env->ThrowError("Vinverse: can't open params file %s!", params);
+        }
+        std::vector<std::string> lines;
+        char line[512];
+        while (fgets(line, sizeof(line), file) != nullptr) {
+            lines.push_back(line);
+        }
+        fclose(file);
 
-    if (buffer == nullptr) {
-        env->ThrowError("Vinverse:  malloc failure!");
+        for (size_t i = 0; i < lines.size(); ++i) {
+            const char *text = lines[i].c_str() + strspn(lines[i].c_str(), " \t\r\n");
+            if (*text == '#' || *text == '\0') {
+                continue;
+            }
+            FrameRangeParams range;
+            float set_sstr, set_scl;
+            int set_amnt;
+            if (sscanf(text, "%d %d %f %d %f", &range.first, &range.last, &set_sstr, &set_amnt, &set_scl) != 5 || range.first < 0 || range.last < range.first || set_amnt < 1 || set_amnt > 255) {
+                env->ThrowError("Vinverse: line %d of the params file must be \"first last sstr amnt scl\" with first <= last and amnt between 1 and 255!", int(i) + 1);
+            }
+            range.processor = add_processor(set_sstr, set_amnt, set_scl);
+            ranges.push_back(range);
+        }
     }
 
-    blur3_buffer = buffer;
-    blur6_buffer = blur3_buffer + pbuf_size;
+    if (prefetch > 0) {
+        prefetcher.reset(new FramePrefetcher(prefetch));
+    }
+    if (deadline > 0) {
+        governor.reset(new DeadlineGovernor(deadline, quality_));
+    }
 
-    if (!sse2) {
-        dlut = reinterpret_cast<int*>(blur6_buffer + pbuf_size);
+    //the aux planes are stacked below the filtered ones, so both come from one GetFrame and Crop separates them
+    if (aux_ != AuxOutput::None) {
+        vi.height *= 2;
+    }
+}
 
-        for (int x=-255; x<=255; ++x)
-        {
-            for (int y=-255; y<=255; ++y)
-            {
-                float y2 = y*sstr;
-                float da = fabs(float(x)) < fabs(y2) ? x : y2;
-                dlut[((x+255)<<9)+(y+255)] = float(x)*y2 < 0.0 ? int(da*scl) : int(da);
-            }
+//the last range of the params file that contains n wins
+const PlaneProcessor *Vinverse::processor_for(int n) const {
+    for (auto range = ranges.rbegin(); range != ranges.rend(); ++range) {
+        if (n >= range->first && n <= range->last) {
+            return processors[range->processor].get();
         }
     }
+    return processors[0].get();
 }
 
-Vinverse::~Vinverse() {
-    _aligned_free(buffer);
+void Vinverse::fetch_frame(int n, FrameJob &job, IScriptEnvironment *env) {
+    job.n = n;
+    job.processor = processor_for(n);
+    job.src = child->GetFrame(n, env);
+    job.dst = env->NewVideoFrame(vi);
+    if (mask_) {
+        job.mask = mask_->GetFrame(n, env);
+    }
 }
 
-PVideoFrame __stdcall Vinverse::GetFrame(int n, IScriptEnvironment *env)
-{
-    PVideoFrame src = child->GetFrame(n, env);
-    PVideoFrame dst = env->NewVideoFrame(vi);
+void Vinverse::describe_planes(FrameJob &job, FrameQuality quality, IScriptEnvironment *env) {
+    job.count = 0;
+    job.draft = quality == FrameQuality::Draft;
+    job.parallel = mt_;
+    job.interleaved = interleave_;
+    const PVideoFrame &src = job.src;
+    const PVideoFrame &dst = job.dst;
+    const PVideoFrame &mask = job.mask;
 
     int planes[3] = { PLANAR_Y, PLANAR_U, PLANAR_V };
 
-    for (int pid = 0; pid < 3; ++pid) {		
+    for (int pid = 0; pid < 3; ++pid) {
         int current_plane = planes[pid];
         if (current_plane != PLANAR_Y && (vi.IsY8() || uv_ == 1)) {
             continue;
@@ -476,74 +1718,372 @@ PVideoFrame __stdcall Vinverse::GetFrame(int n, IScriptEnvironment *env)
         const int width = src->GetRowSize(current_plane);
         uint8_t *dstp = dst->GetWritePtr(current_plane);
         const int dst_pitch = dst->GetPitch(current_plane);
+        uint8_t *auxp = aux_ != AuxOutput::None ? dstp + height * dst_pitch : nullptr;
 
-        if (current_plane != PLANAR_Y && uv_ == 2)
+        //drafts only filter luma
+        const bool copied = quality == FrameQuality::Passthrough || (current_plane != PLANAR_Y && (uv_ == 2 || quality == FrameQuality::Draft));
+        if (copied)
         {
             env->BitBlt(dstp,dst_pitch,srcp,src_pitch,width,height);
+            if (auxp != nullptr) {
+                fill_rows(auxp, dst_pitch, width, height, job.processor->neutral_aux());
+            }
             continue;
         }
-        
-        if ((env->GetCPUFlags() & CPUF_SSE2)) {
-            if (!is_ptr_aligned(srcp, 16)) {
-                env->ThrowError("Invalid memory alignment. For God's sake, stop using unaligned crop!");
-            }
-            if (mode_ == VinverseMode::Vinverse) {
-                vertical_blur3_sse2(blur3_buffer, srcp, pb_pitch, src_pitch, width, height);
-                vertical_blur5_sse2(blur6_buffer, blur3_buffer, pb_pitch, pb_pitch, width, height);
-            } else {
-                if (current_plane == PLANAR_Y) {
-                    vertical_sbr_sse2(blur3_buffer, blur6_buffer, srcp, pb_pitch, pb_pitch, src_pitch, width, height);
-                } else {
-                    env->BitBlt(blur3_buffer, pb_pitch, srcp, src_pitch, width, height);
-                }
-                vertical_blur3_sse2(blur6_buffer, blur3_buffer, pb_pitch, pb_pitch, width, height);
-            }
-            finalize_plane_sse2(dstp, srcp, blur3_buffer, blur6_buffer, sstr_, scl_, src_pitch, dst_pitch, pb_pitch, width, height, amnt_);
-        } else {
-            if (mode_ == VinverseMode::Vinverse) {
-                vertical_blur3_c(blur3_buffer, srcp, pb_pitch, src_pitch, width, height);
-                vertical_blur5_c(blur6_buffer, blur3_buffer, pb_pitch, pb_pitch, width, height);
-            } else {
-                if (current_plane == PLANAR_Y) {
-                    vertical_sbr_c(blur3_buffer, blur6_buffer, srcp, pb_pitch, pb_pitch, src_pitch, width, height);
-                } else {
-                    env->BitBlt(blur3_buffer, pb_pitch, srcp, src_pitch, width, height);
-                }
-                vertical_blur3_c(blur6_buffer, blur3_buffer, pb_pitch, pb_pitch, width, height);
-            }
 
+        if (!is_ptr_aligned(srcp, job.processor->alignment())) {
+            env->ThrowError("Invalid memory alignment. For God's sake, stop using unaligned crop!");
+        }
 
-            if (amnt_ == 255) {
-                finalize_plane_c<true>(dstp, srcp, blur3_buffer, blur6_buffer, dlut, dst_pitch, src_pitch, pb_pitch, width, height, amnt_);
-            } else {
-                finalize_plane_c<false>(dstp, srcp, blur3_buffer, blur6_buffer, dlut, dst_pitch, src_pitch, pb_pitch, width, height, amnt_);
-            }
+        PlaneDesc &desc = job.descs[job.count++];
+        desc.dstp = dstp;
+        desc.srcp = srcp;
+        desc.dst_pitch = dst_pitch;
+        desc.src_pitch = src_pitch;
+        desc.width = width;
+        desc.height = height;
+        desc.luma = current_plane == PLANAR_Y;
+        desc.auxp = auxp;
+        desc.aux_pitch = dst_pitch;
+
+        const int ssx = desc.luma ? 0 : vi.GetPlaneWidthSubsampling(current_plane);
+        const int ssy = desc.luma ? 0 : vi.GetPlaneHeightSubsampling(current_plane);
+        desc.region.x = roi.x >> ssx;
+        desc.region.y = roi.y >> ssy;
+        desc.region.width = ((roi.x + roi.width + (1 << ssx) - 1) >> ssx) - desc.region.x;
+        desc.region.height = ((roi.y + roi.height + (1 << ssy) - 1) >> ssy) - desc.region.y;
+        desc.region.maskp = mask ? mask->GetReadPtr(current_plane) : nullptr;
+        desc.region.mask_pitch = mask ? mask->GetPitch(current_plane) : 0;
+    }
+}
+
+PVideoFrame Vinverse::finish_frame(FrameJob &job, IScriptEnvironment *env) {
+    if (!job.filtered) {
+        env->ThrowError("Vinverse:  malloc failure!");
+    }
+    const FrameStats &stats = job.stats;
+
+    //AviSynth 2.6 has no frame properties, the totals of the last frame are left in global variables for
+    //runtime filters such as WriteFile, which evaluate them right after requesting the frame
+    if (stats_) {
+        env->SetGlobalVar("VinverseChange", AVSValue(float(stats.change)));
+        //script values are 32-bit ints and floats, a float stops being exact above 2^24 which large frames pass,
+        //so the exact total is split into 31-bit halves as well
+        env->SetGlobalVar("VinverseChangeHigh", AVSValue(int(stats.change >> 31)));
+        env->SetGlobalVar("VinverseChangeLow", AVSValue(int(stats.change & 0x7fffffff)));
+        env->SetGlobalVar("VinverseClamped", AVSValue(int(stats.clamped)));
+        env->SetGlobalVar("VinverseScaled", AVSValue(int(stats.scaled)));
+    }
+    return job.dst;
+}
+
+PVideoFrame __stdcall Vinverse::GetFrame(int n, IScriptEnvironment *env)
+{
+    FrameJob job;
+    if (governor) {
+        //the budget covers fetching the source too, so a slow upstream filter pushes this one to draft
+        const LONGLONG start = governor->now();
+        fetch_frame(n, job, env);
+        FrameQuality quality;
+        {
+            std::lock_guard<std::mutex> guard(governor_lock);
+            quality = governor->select(start);
         }
+        describe_planes(job, quality, env);
+        filter_job(job);
+
+        std::lock_guard<std::mutex> guard(governor_lock);
+        governor->update(quality, start);
+        env->SetGlobalVar("VinverseDrafted", AVSValue(governor->drafted));
+        env->SetGlobalVar("VinverseSkipped", AVSValue(governor->skipped));
+        env->SetGlobalVar("VinverseLate", AVSValue(governor->late));
+        return finish_frame(job, env);
+    }
+    if (!prefetcher) {
+        fetch_frame(n, job, env);
+        describe_planes(job, quality_, env);
+        filter_job(job);
+        return finish_frame(job, env);
     }
-    return dst;
+
+    //frames are fetched from the child here, on the host's thread, and only filtered in the background
+    std::lock_guard<std::mutex> guard(request_lock);
+    if (!prefetcher->take(n, job)) {
+        fetch_frame(n, job, env);
+        describe_planes(job, quality_, env);
+        filter_job(job);
+    }
+    for (auto next : prefetcher->missing(n, vi.num_frames)) {
+        std::unique_ptr<FrameJob> ahead(new FrameJob);
+        fetch_frame(next, *ahead, env);
+        describe_planes(*ahead, quality_, env);
+        prefetcher->schedule(std::move(ahead));
+    }
+    return finish_frame(job, env);
 }
 
 
 AVSValue __cdecl Create_Vinverse(AVSValue args, void*, IScriptEnvironment* env) {
-    enum { CLIP, SSTR, AMNT, UV, SCL };
+    enum { CLIP, SSTR, AMNT, UV, SCL, R1, R2, X, Y, W, H, MASK, STATS, AUX, TUNE, NT, PREFETCH, DRAFT, DEADLINE, PARAMS, MT, INTERLEAVE, TAPS };
+    PClip mask = args[MASK].Defined() ? args[MASK].AsClip() : nullptr;
 #pragma warning(disable: 4244) //output is no longer identical when AsFloat is used instead of AsDblDef
-    return new Vinverse(args[CLIP].AsClip(),args[SSTR].AsDblDef(2.7),args[AMNT].AsInt(255), args[UV].AsInt(3),args[SCL].AsDblDef(0.25), VinverseMode::Vinverse, env);
+    return new Vinverse(args[CLIP].AsClip(),args[SSTR].AsDblDef(2.7),args[AMNT].AsInt(255), args[UV].AsInt(3),args[SCL].AsDblDef(0.25), args[R1].AsInt(1), args[R2].AsInt(2), args[TAPS].AsInt(0),
+        args[X].AsInt(0), args[Y].AsInt(0), args[W].AsInt(0), args[H].AsInt(0), mask, args[STATS].AsBool(false), args[AUX].AsInt(0), args[TUNE].AsBool(false), args[NT].AsInt(0), args[PREFETCH].AsInt(0),
+        args[DRAFT].AsBool(false), args[DEADLINE].AsFloat(0.0f), args[PARAMS].AsString(""), args[MT].AsBool(false), args[INTERLEAVE].AsBool(false), VinverseMode::Vinverse, env);
 #pragma warning(default: 4244)
 }
 
 AVSValue __cdecl Create_Vinverse2(AVSValue args, void*, IScriptEnvironment* env) {
-    enum { CLIP, SSTR, AMNT, UV, SCL };
+    enum { CLIP, SSTR, AMNT, UV, SCL, R1, R2, X, Y, W, H, MASK, STATS, AUX, TUNE, NT, PREFETCH, DRAFT, DEADLINE, PARAMS, MT, INTERLEAVE, TAPS };
+    PClip mask = args[MASK].Defined() ? args[MASK].AsClip() : nullptr;
 #pragma warning(disable: 4244)
-    return new Vinverse(args[CLIP].AsClip(), args[SSTR].AsDblDef(2.7), args[AMNT].AsInt(255), args[UV].AsInt(3), args[SCL].AsDblDef(0.25), VinverseMode::Vinverse2, env);
+    return new Vinverse(args[CLIP].AsClip(), args[SSTR].AsDblDef(2.7), args[AMNT].AsInt(255), args[UV].AsInt(3), args[SCL].AsDblDef(0.25), args[R1].AsInt(1), args[R2].AsInt(1), args[TAPS].AsInt(0),
+        args[X].AsInt(0), args[Y].AsInt(0), args[W].AsInt(0), args[H].AsInt(0), mask, args[STATS].AsBool(false), args[AUX].AsInt(0), args[TUNE].AsBool(false), args[NT].AsInt(0), args[PREFETCH].AsInt(0),
+        args[DRAFT].AsBool(false), args[DEADLINE].AsFloat(0.0f), args[PARAMS].AsString(""), args[MT].AsBool(false), args[INTERLEAVE].AsBool(false), VinverseMode::Vinverse2, env);
 #pragma warning(default: 4244)
 }
 
+AVSValue __cdecl Create_VinverseArenaStats(AVSValue, void*, IScriptEnvironment* env) {
+    return env->Sprintf("%s, %d shared lut(s)", scratch_arena.stats(env), lut_cache.size());
+}
+
+AVSValue __cdecl Create_VinverseThreads(AVSValue args, void*, IScriptEnvironment* env) {
+    const int threads = args[0].AsInt();
+    if (threads < 0) {
+        env->ThrowError("VinverseThreads: the thread budget must not be negative!");
+    }
+    scheduler.set_threads(threads);
+    return AVSValue();
+}
+
+struct VinverseProcessor {
+    VinverseProcessor(VinverseMode mode, float sstr, int amnt, float scl, int radius1, int radius2, BlurTaps taps, bool stats, AuxOutput aux, int width, int height)
+    : processor(mode, sstr, amnt, scl, radius1, radius2, taps, stats, aux, width, height, default_pipeline_config(detect_cpu_flags(), width)), stats(stats), aux(aux), width(width), height(height) {}
+
+    PlaneProcessor processor;
+    bool stats;
+    AuxOutput aux;
+    int width;
+    int height;
+};
+
+extern "C" VINVERSE_API VinverseProcessor *__cdecl vinverse_create(int mode, float sstr, int amnt, float scl, int radius1, int radius2, int taps, int stats, int aux, int width, int height) {
+    if (mode < VINVERSE_MODE_VINVERSE || mode > VINVERSE_MODE_VINVERSE2 || amnt < 1 || amnt > 255
+        || radius1 < 1 || radius1 > 3 || radius2 < 1 || radius2 > 3 || taps < VINVERSE_TAPS_BINOMIAL || taps > VINVERSE_TAPS_FLAT || aux < VINVERSE_AUX_NONE || aux > VINVERSE_AUX_CHANGED || width <= 0 || height <= 0) {
+        return nullptr;
+    }
+    VinverseProcessor *processor = new (std::nothrow) VinverseProcessor(mode == VINVERSE_MODE_VINVERSE2 ? VinverseMode::Vinverse2 : VinverseMode::Vinverse,
+        sstr, amnt, scl, radius1, radius2, BlurTaps(taps), stats != 0, AuxOutput(aux), width, height);
+    if (processor != nullptr && !processor->processor.is_valid()) {
+        delete processor;
+        return nullptr;
+    }
+    return processor;
+}
+
+extern "C" VINVERSE_API void __cdecl vinverse_destroy(VinverseProcessor *processor) {
+    delete processor;
+}
+
+extern "C" VINVERSE_API void __cdecl vinverse_set_threads(int threads) {
+    scheduler.set_threads(threads);
+}
+
+extern "C" VINVERSE_API void __cdecl vinverse_set_executor(const VinverseExecutor *executor) {
+    scheduler.set_executor(executor);
+}
+
+extern "C" VINVERSE_API int __cdecl vinverse_alignment(const VinverseProcessor *processor) {
+    return processor->processor.alignment();
+}
+
+//checks a plane passed to the C interface and translates it, returns one of the VINVERSE_ codes
+static int describe_plane(const VinverseProcessor *processor, const VinversePlane *plane, PlaneDesc &desc) {
+    if (processor == nullptr || plane == nullptr || plane->srcp == nullptr || plane->dstp == nullptr) {
+        return VINVERSE_ERROR_ARGUMENT;
+    }
+    if (plane->width <= 0 || plane->height <= 0 || plane->width > processor->width || plane->height > processor->height
+        || plane->src_pitch < plane->width || plane->dst_pitch < plane->width) {
+        return VINVERSE_ERROR_ARGUMENT;
+    }
+    const bool with_aux = processor->aux != AuxOutput::None;
+    if (with_aux && (plane->auxp == nullptr || plane->aux_pitch < plane->width)) {
+        return VINVERSE_ERROR_ARGUMENT;
+    }
+    if (plane->maskp != nullptr && plane->mask_pitch < plane->width) {
+        return VINVERSE_ERROR_ARGUMENT;
+    }
+
+    if (!resolve_region(plane->x, plane->y, plane->w, plane->h, plane->width, plane->height, desc.region)) {
+        return VINVERSE_ERROR_ARGUMENT;
+    }
+    desc.region.maskp = plane->maskp;
+    desc.region.mask_pitch = plane->mask_pitch;
+
+    //the simd kernels work on whole 16 pixel blocks of every row
+    const int alignment = processor->processor.alignment();
+    if (!is_ptr_aligned(plane->srcp, alignment) || !is_ptr_aligned(plane->dstp, alignment) || plane->src_pitch % alignment != 0 || plane->dst_pitch % alignment != 0
+        || (with_aux && (!is_ptr_aligned(plane->auxp, alignment) || plane->aux_pitch % alignment != 0))) {
+        return VINVERSE_ERROR_ALIGNMENT;
+    }
+
+    desc.dstp = plane->dstp;
+    desc.srcp = plane->srcp;
+    desc.dst_pitch = plane->dst_pitch;
+    desc.src_pitch = plane->src_pitch;
+    desc.width = plane->width;
+    desc.height = plane->height;
+    desc.luma = plane->luma != 0;
+    desc.auxp = with_aux ? plane->auxp : nullptr;
+    desc.aux_pitch = with_aux ? plane->aux_pitch : 0;
+    return VINVERSE_OK;
+}
+
+static void add_stats(const VinverseProcessor *processor, const FrameStats &totals, VinverseStats *stats) {
+    if (stats != nullptr && processor->stats) {
+        stats->change += totals.change;
+        stats->clamped += totals.clamped;
+        stats->scaled += totals.scaled;
+    }
+}
+
+extern "C" VINVERSE_API int __cdecl vinverse_process(const VinverseProcessor *processor, const VinversePlane *plane, VinverseStats *stats) {
+    PlaneDesc desc;
+    const int error = describe_plane(processor, plane, desc);
+    if (error != VINVERSE_OK) {
+        return error;
+    }
+
+    ScratchLease scratch(scratch_arena, processor->processor.scratch_size());
+    if (scratch.get() == nullptr) {
+        return VINVERSE_ERROR_MEMORY;
+    }
+
+    FrameStats totals = { 0, 0, 0 };
+    processor->processor.process_planes(&desc, 1, &totals, scratch.get());
+    add_stats(processor, totals, stats);
+    return VINVERSE_OK;
+}
+
+extern "C" VINVERSE_API int __cdecl vinverse_process_batch(const VinverseProcessor *processor, const VinversePlane *planes, int count, VinverseStats *stats) {
+    if (planes == nullptr || count < 0) {
+        return VINVERSE_ERROR_ARGUMENT;
+    }
+    //nothing is written unless every plane is valid
+    std::vector<PlaneDesc> descs(count);
+    for (int i = 0; i < count; ++i) {
+        const int error = describe_plane(processor, &planes[i], descs[i]);
+        if (error != VINVERSE_OK) {
+            return error;
+        }
+    }
+    if (count == 0) {
+        return VINVERSE_OK;
+    }
+
+    //each worker leases its scratch once and then claims planes until none are left, so a worker that
+    //got no scratch leaves its share to the others
+    const int workers = std::min(count, scheduler.concurrency());
+    std::vector<FrameStats> totals(count);
+    std::atomic<int> next(0);
+    std::atomic<int> finished(0);
+    scheduler.run_all(workers, [&](int) {
+        ScratchLease scratch(scratch_arena, processor->processor.scratch_size());
+        if (scratch.get() == nullptr) {
+            return;
+        }
+        for (int i = next++; i < count; i = next++) {
+            totals[i].change = totals[i].clamped = totals[i].scaled = 0;
+            processor->processor.process_planes(&descs[i], 1, &totals[i], scratch.get());
+            ++finished;
+        }
+    });
+    if (finished < count) {
+        return VINVERSE_ERROR_MEMORY;
+    }
+    if (stats != nullptr) {
+        for (int i = 0; i < count; ++i) {
+            add_stats(processor, totals[i], &stats[i]);
+        }
+    }
+    return VINVERSE_OK;
+}
+
+//A plane filtered as its rows arrive. The scratch is leased for the whole lifetime of the stream.
+struct VinverseStream {
+    VinverseStream(const VinverseProcessor *processor, int height)
+    : processor(processor), scratch(scratch_arena, processor->processor.scratch_size()), pushed(0), height(height) {
+        totals.change = totals.clamped = totals.scaled = 0;
+    }
+
+    const VinverseProcessor *processor;
+    ScratchLease scratch;
+    FrameStats totals;
+    std::unique_ptr<PlanePipeline> pipeline;
+    int pushed;
+    int height;
+};
+
+extern "C" VINVERSE_API int __cdecl vinverse_stream_begin(const VinverseProcessor *processor, const VinversePlane *plane, VinverseStream **stream) {
+    if (stream == nullptr) {
+        return VINVERSE_ERROR_ARGUMENT;
+    }
+    *stream = nullptr;
+    PlaneDesc desc;
+    const int error = describe_plane(processor, plane, desc);
+    if (error != VINVERSE_OK) {
+        return error;
+    }
+    //regions and masks decide which rows to filter before any of them is there, so only whole planes stream
+    const PlaneRegion &region = desc.region;
+    if (region.maskp != nullptr || region.x != 0 || region.y != 0 || region.width != desc.width || region.height != desc.height) {
+        return VINVERSE_ERROR_ARGUMENT;
+    }
+
+    std::unique_ptr<VinverseStream> created(new (std::nothrow) VinverseStream(processor, desc.height));
+    if (created == nullptr || created->scratch.get() == nullptr) {
+        return VINVERSE_ERROR_MEMORY;
+    }
+    created->pipeline = processor->processor.make_pipeline(desc, &created->totals, created->scratch.get());
+    if (created->pipeline == nullptr) {
+        return VINVERSE_ERROR_MEMORY;
+    }
+    *stream = created.release();
+    return VINVERSE_OK;
+}
+
+extern "C" VINVERSE_API int __cdecl vinverse_stream_push(VinverseStream *stream, int rows) {
+    if (stream == nullptr || rows < 0) {
+        return VINVERSE_ERROR_ARGUMENT;
+    }
+    const int target = stream->pushed + std::min(rows, stream->height - stream->pushed);
+    const int strip = stream->processor->processor.strip_rows();
+    while (stream->pushed < target) {
+        const int count = std::min(strip, target - stream->pushed);
+        stream->pipeline->push_rows(count);
+        stream->pushed += count;
+    }
+    return stream->pipeline->finished_rows();
+}
+
+extern "C" VINVERSE_API int __cdecl vinverse_stream_flush(VinverseStream *stream, VinverseStats *stats) {
+    if (stream == nullptr) {
+        return VINVERSE_ERROR_ARGUMENT;
+    }
+    vinverse_stream_push(stream, stream->height - stream->pushed);
+    add_stats(stream->processor, stream->totals, stats);
+    delete stream;
+    return VINVERSE_OK;
+}
+
 const AVS_Linkage *AVS_linkage = nullptr;
 
-extern "C" __declspec(dllexport) const char* __stdcall AvisynthPluginInit3(IScriptEnvironment* env, const AVS_Linkage* const vectors) {
+extern "C" VINVERSE_API const char* __stdcall AvisynthPluginInit3(IScriptEnvironment* env, const AVS_Linkage* const vectors) {
     AVS_linkage = vectors;
 
-    env->AddFunction("vinverse", "c[sstr]f[amnt]i[uv]i[scl]f", Create_Vinverse, 0);
-    env->AddFunction("vinverse2", "c[sstr]f[amnt]i[uv]i[scl]f", Create_Vinverse2, 0);
+    env->AddFunction("vinverse", "c[sstr]f[amnt]i[uv]i[scl]f[r1]i[r2]i[x]i[y]i[w]i[h]i[mask]c[stats]b[aux]i[tune]b[nt]i[prefetch]i[draft]b[deadline]f[params]s[mt]b[interleave]b[taps]i", Create_Vinverse, 0);
+    env->AddFunction("vinverse2", "c[sstr]f[amnt]i[uv]i[scl]f[r1]i[r2]i[x]i[y]i[w]i[h]i[mask]c[stats]b[aux]i[tune]b[nt]i[prefetch]i[draft]b[deadline]f[params]s[mt]b[interleave]b[taps]i", Create_Vinverse2, 0);
+    env->AddFunction("VinverseArenaStats", "", Create_VinverseArenaStats, 0);
+    env->AddFunction("VinverseThreads", "i", Create_VinverseThreads, 0);
     return "Doushimashita?";
 }
\ No newline at end of file
@@ -0,0 +1,124 @@
+#ifndef VINVERSE_API_H
+#define VINVERSE_API_H
+
+#include <stdint.h>
+
+//Plain C interface to the vinverse plane processing, exported from the plugin dll for callers outside
+//AviSynth. Planes are read and written in place, nothing is copied.
+
+//the plugin defines VINVERSE_BUILD before including this, callers import the functions from the dll
+#ifdef VINVERSE_BUILD
+#define VINVERSE_API __declspec(dllexport)
+#else
+#define VINVERSE_API __declspec(dllimport)
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct VinverseProcessor VinverseProcessor;
+
+enum {
+    VINVERSE_MODE_VINVERSE = 0,
+    VINVERSE_MODE_VINVERSE2 = 1
+};
+
+enum {
+    VINVERSE_TAPS_BINOMIAL = 0,
+    VINVERSE_TAPS_FLAT = 1
+};
+
+enum {
+    VINVERSE_AUX_NONE = 0,
+    VINVERSE_AUX_DIFFERENCE = 1,
+    VINVERSE_AUX_CHANGED = 2
+};
+
+enum {
+    VINVERSE_OK = 0,
+    VINVERSE_ERROR_ARGUMENT = -1,
+    VINVERSE_ERROR_ALIGNMENT = -2,
+    VINVERSE_ERROR_MEMORY = -3
+};
+
+typedef struct VinversePlane {
+    const uint8_t *srcp;
+    int src_pitch;
+    uint8_t *dstp;
+    int dst_pitch;
+    uint8_t *auxp;          //required when the processor was created with aux output
+    int aux_pitch;
+    const uint8_t *maskp;   //optional, same size as the plane
+    int mask_pitch;
+    int width;
+    int height;
+    int luma;               //vinverse2 only sharpens luma
+    int x, y, w, h;         //region, same convention as the filter parameters; all 0 for the whole plane
+} VinversePlane;
+
+typedef struct VinverseStats {
+    uint64_t change;
+    uint64_t clamped;
+    uint64_t scaled;
+} VinverseStats;
+
+//Parameters match vinverse() and vinverse2(); stats and aux are 0 or the values of the filter parameters.
+//radius1 and radius2 are r1 and r2, whose defaults differ between the modes (1, 2 and 1, 1), and taps is
+//the taps parameter, one of the VINVERSE_TAPS_ values.
+//The output is written through the cache as with nt=0.
+//Planes up to width x height can be processed. Returns NULL on invalid parameters or allocation failure.
+VINVERSE_API VinverseProcessor *__cdecl vinverse_create(int mode, float sstr, int amnt, float scl, int radius1, int radius2, int taps, int stats, int aux, int width, int height);
+VINVERSE_API void __cdecl vinverse_destroy(VinverseProcessor *processor);
+
+//Required alignment of the plane pointers and pitches, 16 unless the cpu lacks SSE2. The output and aux rows
+//are written in whole blocks of that size, so the padding after each row up to the pitch may be overwritten.
+VINVERSE_API int __cdecl vinverse_alignment(const VinverseProcessor *processor);
+
+//Safe to call from several threads with the same processor. stats may be NULL, otherwise the totals of the
+//plane are added to it when the processor was created with stats.
+VINVERSE_API int __cdecl vinverse_process(const VinverseProcessor *processor, const VinversePlane *plane, VinverseStats *stats);
+
+//Filters count planes on the scheduler's threads (see vinverse_set_threads), the calling one included, and
+//returns once all are done. Every plane is checked before any is filtered. stats may be NULL, otherwise it
+//points to count entries and each gets the totals of its plane added as with vinverse_process.
+VINVERSE_API int __cdecl vinverse_process_batch(const VinverseProcessor *processor, const VinversePlane *planes, int count, VinverseStats *stats);
+
+typedef struct VinverseStream VinverseStream;
+
+//Slice-incremental processing for sources that deliver a plane in row slices, such as decoders and
+//capture cards. begin takes the plane as for vinverse_process, but only whole planes (x, y, w, h all 0
+//and no mask), and its source rows don't have to be there yet. push reports that the next rows from the
+//top have arrived and returns the number of output (and aux) rows from the top that are final, which
+//trails the pushed rows by the blur lookahead of a few rows, or a negative error. flush filters the
+//remaining rows as if they had all arrived, adds the stats and frees the stream. The processor and the
+//plane's buffers have to stay valid until then; one stream is used from one thread at a time.
+VINVERSE_API int __cdecl vinverse_stream_begin(const VinverseProcessor *processor, const VinversePlane *plane, VinverseStream **stream);
+VINVERSE_API int __cdecl vinverse_stream_push(VinverseStream *stream, int rows);
+VINVERSE_API int __cdecl vinverse_stream_flush(VinverseStream *stream, VinverseStats *stats);
+
+//Background work of the AviSynth filter (prefetch and mt) runs as tasks on one process-wide scheduler.
+//Its built-in pool starts at most the thread budget of workers, by default one per logical processor;
+//a budget of 0 restores that default. Workers start on demand and exit when the last filter instance
+//goes away; lowering the budget retires the workers above it as soon as they finish their task.
+VINVERSE_API void __cdecl vinverse_set_threads(int threads);
+
+typedef void (__cdecl *VinverseTask)(void *context);
+
+//An application's own thread pool. submit has to run task(context) exactly once, on any thread, and may
+//do so before returning. Nothing waits for a task that hasn't started, so they can be queued behind any
+//amount of other work, but every task has to have run before the dll is unloaded.
+typedef struct VinverseExecutor {
+    void (__cdecl *submit)(void *user, VinverseTask task, void *context);
+    void *user;
+} VinverseExecutor;
+
+//Routes all tasks to executor from now on, NULL goes back to the built-in pool. Tasks already handed out
+//stay where they are.
+VINVERSE_API void __cdecl vinverse_set_executor(const VinverseExecutor *executor);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,61 @@
+//The AVX2 tier. This file is compiled with /arch:AVX2, so everything in it is VEX encoded, the 128 bit
+//tail columns and the reductions of the stats included, and it only runs after select_kernel_tier
+//found AVX2. Nothing that runs on other cpus may be defined here.
+
+#include "vinverse_kernels.h"
+
+namespace {
+
+
+//Rows are only aligned to 16 bytes, so 32 byte loads and stores are unaligned ones. Non-temporal stores
+//need the alignment, they go out whole on rows that happen to start on 32 bytes and in halves on the others.
+struct Vec256 {
+    typedef __m256i V;
+    typedef __m256 F;
+    enum { width = 32 };
+
+    static __forceinline V load(const uint8_t *p) { return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p)); }
+    static __forceinline V loadu(const uint8_t *p) { return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p)); }
+    static __forceinline void store(uint8_t *p, V x) { _mm256_storeu_si256(reinterpret_cast<__m256i*>(p), x); }
+    static __forceinline void stream(uint8_t *p, V x) {
+        if ((reinterpret_cast<uintptr_t>(p) & 31) == 0) {
+            _mm256_stream_si256(reinterpret_cast<__m256i*>(p), x);
+        } else {
+            _mm_stream_si128(reinterpret_cast<__m128i*>(p), _mm256_castsi256_si128(x));
+            _mm_stream_si128(reinterpret_cast<__m128i*>(p + 16), _mm256_extracti128_si256(x, 1));
+        }
+    }
+    static __forceinline V zero() { return _mm256_setzero_si256(); }
+    static __forceinline V set1_epi8(char x) { return _mm256_set1_epi8(x); }
+    static __forceinline V set1_epi16(short x) { return _mm256_set1_epi16(x); }
+    static __forceinline F set1_ps(float x) { return _mm256_set1_ps(x); }
+    static __forceinline void leave() { _mm256_zeroupper(); }
+};
+
+//The SSE4.1 tier at twice the width. It's picked at run time from CPUF_AVX2, which also requires the OS
+//to save the 256 bit registers.
+struct Avx2 : Vec256 {
+    typedef Sse41 Half;
+
+    static __forceinline V blend(V const &mask, V const &desired, V const &otherwise) {
+        return _mm256_blendv_epi8(otherwise, desired, mask);
+    }
+
+    static __forceinline F blend_ps(F const &mask, F const &desired, F const &otherwise) {
+        return _mm256_blendv_ps(otherwise, desired, mask);
+    }
+
+    static __forceinline V abs_epi16(const V &src) {
+        return _mm256_abs_epi16(src);
+    }
+};
+
+}
+
+PlaneSteps make_avx2_plane_steps(VinverseMode mode, bool amnt_255, bool with_stats, AuxOutput aux) {
+    return make_plane_steps<SimdKernels<Avx2> >(mode, amnt_255, with_stats, aux);
+}
+
+PlaneSteps make_avx2_draft_steps(VinverseMode mode, bool amnt_255, bool with_stats, AuxOutput aux) {
+    return make_plane_steps<DraftKernels<Avx2> >(mode, amnt_255, with_stats, aux);
+}
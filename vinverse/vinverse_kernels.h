@@ -0,0 +1,1198 @@
+#ifndef VINVERSE_KERNELS_H
+#define VINVERSE_KERNELS_H
+
+//Kernels and the plane pipeline, shared by vinverse.cpp and vinverse_avx2.cpp. The second is compiled
+//with /arch:AVX2, so the kernel templates are in an unnamed namespace: every file gets its own copies,
+//and the linker can't pick a VEX encoded instantiation of an SSE tier for the code that runs without AVX2.
+
+#include <emmintrin.h>
+#include <smmintrin.h>
+#include <immintrin.h>
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+
+
+//Per-frame totals gathered by the finalize pass: sum of |dst - src|, pixels limited by amnt (or the
+//0-255 range) and pixels where the opposite signs of the two differences made scl apply.
+struct FrameStats {
+    uint64_t change;
+    uint64_t clamped;
+    uint64_t scaled;
+};
+
+//Optional second plane written by the finalize pass, stacked below the filtered one.
+enum class AuxOutput {
+    None,
+    Difference, //src - blur3 + 128, the vertical detail vinverse works on
+    Changed     //255 where the filter modified the pixel, 0 elsewhere
+};
+
+//Compile-time choices for the finalize pass, so the plain variant carries no extra work. streaming
+//writes the output with non-temporal stores; only the simd kernels have them.
+template<bool amnt_255_, bool with_stats_, AuxOutput aux_, bool streaming_ = false>
+struct FinalizeOptions {
+    static const bool amnt_255 = amnt_255_;
+    static const bool with_stats = with_stats_;
+    static const AuxOutput aux = aux_;
+    static const bool streaming = streaming_;
+
+    typedef FinalizeOptions<amnt_255_, false, aux_, streaming_> without_stats;
+    typedef FinalizeOptions<amnt_255_, with_stats_, aux_, true> with_streaming;
+};
+
+//Tap set of both blurs, the values of the taps parameter
+enum class BlurTaps {
+    Binomial,
+    Flat
+};
+
+enum class VinverseMode {
+    Vinverse,
+    Vinverse2
+};
+
+namespace {
+
+//Vector widths the instruction set tiers below are built on: the vector types, loads, stores and
+//constants. leave() has to run before code of another width, the 256 bit registers are cleared there
+//so the 128 bit code that follows doesn't pay for the transition.
+struct Vec128 {
+    typedef __m128i V;
+    typedef __m128 F;
+    enum { width = 16 };
+
+    static __forceinline V load(const uint8_t *p) { return _mm_load_si128(reinterpret_cast<const __m128i*>(p)); }
+    static __forceinline V loadu(const uint8_t *p) { return _mm_loadu_si128(reinterpret_cast<const __m128i*>(p)); }
+    static __forceinline void store(uint8_t *p, V x) { _mm_store_si128(reinterpret_cast<__m128i*>(p), x); }
+    static __forceinline void stream(uint8_t *p, V x) { _mm_stream_si128(reinterpret_cast<__m128i*>(p), x); }
+    static __forceinline V zero() { return _mm_setzero_si128(); }
+    static __forceinline V set1_epi8(char x) { return _mm_set1_epi8(x); }
+    static __forceinline V set1_epi16(short x) { return _mm_set1_epi16(x); }
+    static __forceinline F set1_ps(float x) { return _mm_set1_ps(x); }
+    static __forceinline void leave() {}
+};
+
+//Lane operations of both widths, so the kernels are written once against Isa::V. The 256 bit unpacks
+//and packs work within each 128 bit half; kernels that widen with unpacklo/unpackhi and pack the two
+//results back in that order get every pixel back in its place.
+static __forceinline __m128i and_si(__m128i a, __m128i b) { return _mm_and_si128(a, b); }
+static __forceinline __m128i or_si(__m128i a, __m128i b) { return _mm_or_si128(a, b); }
+static __forceinline __m128i andnot_si(__m128i a, __m128i b) { return _mm_andnot_si128(a, b); }
+static __forceinline __m128i xor_si(__m128i a, __m128i b) { return _mm_xor_si128(a, b); }
+static __forceinline __m128i add_epi8(__m128i a, __m128i b) { return _mm_add_epi8(a, b); }
+static __forceinline __m128i sub_epi8(__m128i a, __m128i b) { return _mm_sub_epi8(a, b); }
+static __forceinline __m128i subs_epi8(__m128i a, __m128i b) { return _mm_subs_epi8(a, b); }
+static __forceinline __m128i avg_epu8(__m128i a, __m128i b) { return _mm_avg_epu8(a, b); }
+static __forceinline __m128i cmpeq_epi8(__m128i a, __m128i b) { return _mm_cmpeq_epi8(a, b); }
+static __forceinline __m128i add_epi16(__m128i a, __m128i b) { return _mm_add_epi16(a, b); }
+static __forceinline __m128i sub_epi16(__m128i a, __m128i b) { return _mm_sub_epi16(a, b); }
+static __forceinline __m128i adds_epi16(__m128i a, __m128i b) { return _mm_adds_epi16(a, b); }
+static __forceinline __m128i subs_epi16(__m128i a, __m128i b) { return _mm_subs_epi16(a, b); }
+static __forceinline __m128i mullo_epi16(__m128i a, __m128i b) { return _mm_mullo_epi16(a, b); }
+static __forceinline __m128i mulhi_epi16(__m128i a, __m128i b) { return _mm_mulhi_epi16(a, b); }
+static __forceinline __m128i max_epi16(__m128i a, __m128i b) { return _mm_max_epi16(a, b); }
+static __forceinline __m128i min_epi16(__m128i a, __m128i b) { return _mm_min_epi16(a, b); }
+static __forceinline __m128i cmpeq_epi16(__m128i a, __m128i b) { return _mm_cmpeq_epi16(a, b); }
+static __forceinline __m128i cmpgt_epi16(__m128i a, __m128i b) { return _mm_cmpgt_epi16(a, b); }
+static __forceinline __m128i cmplt_epi16(__m128i a, __m128i b) { return _mm_cmplt_epi16(a, b); }
+static __forceinline __m128i unpacklo_epi8(__m128i a, __m128i b) { return _mm_unpacklo_epi8(a, b); }
+static __forceinline __m128i unpackhi_epi8(__m128i a, __m128i b) { return _mm_unpackhi_epi8(a, b); }
+static __forceinline __m128i unpacklo_epi16(__m128i a, __m128i b) { return _mm_unpacklo_epi16(a, b); }
+static __forceinline __m128i unpackhi_epi16(__m128i a, __m128i b) { return _mm_unpackhi_epi16(a, b); }
+static __forceinline __m128i packus_epi16(__m128i a, __m128i b) { return _mm_packus_epi16(a, b); }
+static __forceinline __m128i packs_epi16(__m128i a, __m128i b) { return _mm_packs_epi16(a, b); }
+static __forceinline __m128i packs_epi32(__m128i a, __m128i b) { return _mm_packs_epi32(a, b); }
+static __forceinline __m128i sad_epu8(__m128i a, __m128i b) { return _mm_sad_epu8(a, b); }
+static __forceinline __m128i add_epi64(__m128i a, __m128i b) { return _mm_add_epi64(a, b); }
+template<int count> static __forceinline __m128i slli_epi16(__m128i a) { return _mm_slli_epi16(a, count); }
+template<int count> static __forceinline __m128i srli_epi16(__m128i a) { return _mm_srli_epi16(a, count); }
+static __forceinline __m128 cvtepi32_ps(__m128i a) { return _mm_cvtepi32_ps(a); }
+static __forceinline __m128i cvttps_epi32(__m128 a) { return _mm_cvttps_epi32(a); }
+static __forceinline __m128i castps_si(__m128 a) { return _mm_castps_si128(a); }
+static __forceinline __m128 mul_ps(__m128 a, __m128 b) { return _mm_mul_ps(a, b); }
+static __forceinline __m128 cmplt_ps(__m128 a, __m128 b) { return _mm_cmplt_ps(a, b); }
+static __forceinline __m128 abs_ps(__m128 a) { return _mm_andnot_ps(_mm_set1_ps(-0.0f), a); } // -0.f = 1 << 31
+
+static __forceinline __m256i and_si(__m256i a, __m256i b) { return _mm256_and_si256(a, b); }
+static __forceinline __m256i or_si(__m256i a, __m256i b) { return _mm256_or_si256(a, b); }
+static __forceinline __m256i andnot_si(__m256i a, __m256i b) { return _mm256_andnot_si256(a, b); }
+static __forceinline __m256i xor_si(__m256i a, __m256i b) { return _mm256_xor_si256(a, b); }
+static __forceinline __m256i add_epi8(__m256i a, __m256i b) { return _mm256_add_epi8(a, b); }
+static __forceinline __m256i sub_epi8(__m256i a, __m256i b) { return _mm256_sub_epi8(a, b); }
+static __forceinline __m256i subs_epi8(__m256i a, __m256i b) { return _mm256_subs_epi8(a, b); }
+static __forceinline __m256i avg_epu8(__m256i a, __m256i b) { return _mm256_avg_epu8(a, b); }
+static __forceinline __m256i cmpeq_epi8(__m256i a, __m256i b) { return _mm256_cmpeq_epi8(a, b); }
+static __forceinline __m256i add_epi16(__m256i a, __m256i b) { return _mm256_add_epi16(a, b); }
+static __forceinline __m256i sub_epi16(__m256i a, __m256i b) { return _mm256_sub_epi16(a, b); }
+static __forceinline __m256i adds_epi16(__m256i a, __m256i b) { return _mm256_adds_epi16(a, b); }
+static __forceinline __m256i subs_epi16(__m256i a, __m256i b) { return _mm256_subs_epi16(a, b); }
+static __forceinline __m256i mullo_epi16(__m256i a, __m256i b) { return _mm256_mullo_epi16(a, b); }
+static __forceinline __m256i mulhi_epi16(__m256i a, __m256i b) { return _mm256_mulhi_epi16(a, b); }
+static __forceinline __m256i max_epi16(__m256i a, __m256i b) { return _mm256_max_epi16(a, b); }
+static __forceinline __m256i min_epi16(__m256i a, __m256i b) { return _mm256_min_epi16(a, b); }
+static __forceinline __m256i cmpeq_epi16(__m256i a, __m256i b) { return _mm256_cmpeq_epi16(a, b); }
+static __forceinline __m256i cmpgt_epi16(__m256i a, __m256i b) { return _mm256_cmpgt_epi16(a, b); }
+static __forceinline __m256i cmplt_epi16(__m256i a, __m256i b) { return _mm256_cmpgt_epi16(b, a); }
+static __forceinline __m256i unpacklo_epi8(__m256i a, __m256i b) { return _mm256_unpacklo_epi8(a, b); }
+static __forceinline __m256i unpackhi_epi8(__m256i a, __m256i b) { return _mm256_unpackhi_epi8(a, b); }
+static __forceinline __m256i unpacklo_epi16(__m256i a, __m256i b) { return _mm256_unpacklo_epi16(a, b); }
+static __forceinline __m256i unpackhi_epi16(__m256i a, __m256i b) { return _mm256_unpackhi_epi16(a, b); }
+static __forceinline __m256i packus_epi16(__m256i a, __m256i b) { return _mm256_packus_epi16(a, b); }
+static __forceinline __m256i packs_epi16(__m256i a, __m256i b) { return _mm256_packs_epi16(a, b); }
+static __forceinline __m256i packs_epi32(__m256i a, __m256i b) { return _mm256_packs_epi32(a, b); }
+static __forceinline __m256i sad_epu8(__m256i a, __m256i b) { return _mm256_sad_epu8(a, b); }
+static __forceinline __m256i add_epi64(__m256i a, __m256i b) { return _mm256_add_epi64(a, b); }
+template<int count> static __forceinline __m256i slli_epi16(__m256i a) { return _mm256_slli_epi16(a, count); }
+template<int count> static __forceinline __m256i srli_epi16(__m256i a) { return _mm256_srli_epi16(a, count); }
+static __forceinline __m256 cvtepi32_ps(__m256i a) { return _mm256_cvtepi32_ps(a); }
+static __forceinline __m256i cvttps_epi32(__m256 a) { return _mm256_cvttps_epi32(a); }
+static __forceinline __m256i castps_si(__m256 a) { return _mm256_castps_si256(a); }
+static __forceinline __m256 mul_ps(__m256 a, __m256 b) { return _mm256_mul_ps(a, b); }
+static __forceinline __m256 cmplt_ps(__m256 a, __m256 b) { return _mm256_cmp_ps(a, b, _CMP_LT_OS); }
+static __forceinline __m256 abs_ps(__m256 a) { return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a); }
+
+//Stays in registers, so in vinverse_avx2.cpp it's VEX encoded along with the kernels around it
+static __forceinline uint64_t hsum_epi64(__m128i x) {
+    uint64_t sum;
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(&sum), _mm_add_epi64(x, _mm_unpackhi_epi64(x, x)));
+    return sum;
+}
+
+static __forceinline uint64_t hsum_epi64(__m256i x) {
+    return hsum_epi64(_mm_add_epi64(_mm256_castsi256_si128(x), _mm256_extracti128_si256(x, 1)));
+}
+
+//Instruction set tiers for the simd kernels. Each kernel is written once as a template over a tier and
+//instantiated per tier; a tier picks the vector width and provides the operations that have a better
+//native form on it. Rows are only padded to 16 bytes, so a wider tier leaves the last columns of a row
+//that don't fill one of its vectors to the 128 bit tier in Half.
+struct Sse2 : Vec128 {
+    typedef Sse2 Half;
+
+    //mask ? a : b
+    static __forceinline V blend(V const &mask, V const &desired, V const &otherwise) {
+        return or_si(and_si(mask, desired), andnot_si(mask, otherwise));
+    }
+
+    //mask ? a : b
+    static __forceinline F blend_ps(F const &mask, F const &desired, F const &otherwise) {
+        return _mm_or_ps(_mm_and_ps(mask, desired), _mm_andnot_ps(mask, otherwise));
+    }
+
+    static __forceinline V abs_epi16(const V &src) {
+        auto zero = _mm_setzero_si128();
+        return blend(cmplt_epi16(src, zero), subs_epi16(zero, src), src);
+    }
+};
+
+//pabsw
+struct Ssse3 : Sse2 {
+    typedef Ssse3 Half;
+
+    static __forceinline V abs_epi16(const V &src) {
+        return _mm_abs_epi16(src);
+    }
+};
+
+//pblendvb and blendvps
+struct Sse41 : Ssse3 {
+    typedef Sse41 Half;
+
+    static __forceinline V blend(V const &mask, V const &desired, V const &otherwise) {
+        return _mm_blendv_epi8(otherwise, desired, mask);
+    }
+
+    static __forceinline F blend_ps(F const &mask, F const &desired, F const &otherwise) {
+        return _mm_blendv_ps(otherwise, desired, mask);
+    }
+};
+
+//Columns of a row of width pixels that fill whole vectors of the tier, the rest goes to Isa::Half.
+//Rows are padded to 16, so for the 128 bit tiers that's all of them.
+template<typename Isa>
+static __forceinline int wide_columns(int width) {
+    return (width + 15) / 16 * 16 / Isa::width * Isa::width;
+}
+
+//Tap sets of the vertical blurs for radius 1 to 3, normalized by a shift. The weights are compile-time
+//constants, so the kernels fold them into adds and shifts where they can. The taps parameter picks the set
+//for both blurs, r1/r2 their radius, and sstr scales what is made of them.
+
+//[1 2 1], [1 4 6 4 1] and [1 6 15 20 15 6 1], the blurs of the original filter
+template<int radius_>
+struct BinomialTaps;
+
+template<>
+struct BinomialTaps<1> {
+    enum { radius = 1, shift = 2 };
+    static __forceinline int weight(int k) { return k == 0 ? 2 : 1; }
+};
+
+template<>
+struct BinomialTaps<2> {
+    enum { radius = 2, shift = 4 };
+    static __forceinline int weight(int k) { return k == 0 ? 6 : k == 1 ? 4 : 1; }
+};
+
+template<>
+struct BinomialTaps<3> {
+    enum { radius = 3, shift = 6 };
+    static __forceinline int weight(int k) { return k == 0 ? 20 : k == 1 ? 15 : k == 2 ? 6 : 1; }
+};
+
+//[5 6 5], [3 3 4 3 3] and [9 9 9 10 9 9 9], as close to a box as the shift allows. The outer rows weigh
+//as much as the inner ones, so more of the combing is removed at the same radius, and more detail with it.
+template<int radius_>
+struct FlatTaps;
+
+template<>
+struct FlatTaps<1> {
+    enum { radius = 1, shift = 4 };
+    static __forceinline int weight(int k) { return k == 0 ? 6 : 5; }
+};
+
+template<>
+struct FlatTaps<2> {
+    enum { radius = 2, shift = 4 };
+    static __forceinline int weight(int k) { return k == 0 ? 4 : 3; }
+};
+
+template<>
+struct FlatTaps<3> {
+    enum { radius = 3, shift = 6 };
+    static __forceinline int weight(int k) { return k == 0 ? 10 : 9; }
+};
+
+//rows[radius] is the center row, rows[radius - k] and rows[radius + k] its neighbours at distance k.
+//The tier parameter only matches the simd row kernels, plain C has none.
+template<typename, typename Taps>
+struct BlurRowC {
+    static __forceinline void run(uint8_t *dstp, const uint8_t *const *rows, int width) {
+        const int radius = Taps::radius;
+        for (int x = 0; x < width; ++x) {
+            int sum = rows[radius][x] * Taps::weight(0) + (1 << (Taps::shift - 1));
+            for (int k = 1; k <= radius; ++k) {
+                sum += (rows[radius - k][x] + rows[radius + k][x]) * Taps::weight(k);
+            }
+            dstp[x] = sum >> Taps::shift;
+        }
+    }
+};
+
+template<typename Isa>
+static __forceinline typename Isa::V mul_weight_epi16(typename Isa::V x, int weight) {
+    switch (weight) {
+    case 1: return x;
+    case 2: return slli_epi16<1>(x);
+    case 4: return slli_epi16<2>(x);
+    default: return mullo_epi16(x, Isa::set1_epi16(short(weight)));
+    }
+}
+
+//16 bits are enough: the weights of radius 3 sum to 64 and 64*255 < 32768
+template<typename Isa, typename Taps>
+struct BlurRowSimd {
+    static __forceinline void run(uint8_t *dstp, const uint8_t *const *rows, int width) {
+        const int radius = Taps::radius;
+        auto zero = Isa::zero();
+        auto rounding = Isa::set1_epi16(1 << (Taps::shift - 1));
+
+        for (int x = 0; x < width; x += Isa::width) {
+            auto c = Isa::load(rows[radius] + x);
+            auto acc_lo = add_epi16(mul_weight_epi16<Isa>(unpacklo_epi8(c, zero), Taps::weight(0)), rounding);
+            auto acc_hi = add_epi16(mul_weight_epi16<Isa>(unpackhi_epi8(c, zero), Taps::weight(0)), rounding);
+
+            for (int k = 1; k <= radius; ++k) {
+                auto p = Isa::load(rows[radius - k] + x);
+                auto n = Isa::load(rows[radius + k] + x);
+                auto t_lo = add_epi16(unpacklo_epi8(p, zero), unpacklo_epi8(n, zero));
+                auto t_hi = add_epi16(unpackhi_epi8(p, zero), unpackhi_epi8(n, zero));
+                acc_lo = add_epi16(acc_lo, mul_weight_epi16<Isa>(t_lo, Taps::weight(k)));
+                acc_hi = add_epi16(acc_hi, mul_weight_epi16<Isa>(t_hi, Taps::weight(k)));
+            }
+
+            acc_lo = srli_epi16<Taps::shift>(acc_lo);
+            acc_hi = srli_epi16<Taps::shift>(acc_hi);
+            Isa::store(dstp + x, packus_epi16(acc_lo, acc_hi));
+        }
+    }
+};
+
+//Averages level[k] with level[k + 1] for k from index to count - 1, then starts the next level with one
+//value less. Recursing over the indices instead of looping keeps every row in a register. pavgb rounds
+//up, and on complemented values it rounds down, avg(~a, ~b) = ~((a + b) >> 1). Complementing every
+//result as it's produced makes the levels alternate between rounding up and down, so their bias cancels
+//instead of adding up over the levels.
+template<typename V, int count, int index>
+struct PavgbLevels {
+    static __forceinline void run(V *level, V flip) {
+        level[index] = xor_si(avg_epu8(level[index], level[index + 1]), flip);
+        PavgbLevels<V, count, index + 1>::run(level, flip);
+    }
+};
+
+template<typename V, int count>
+struct PavgbLevels<V, count, count> {
+    static __forceinline void run(V *level, V flip) {
+        PavgbLevels<V, count - 1, 0>::run(level, flip);
+    }
+};
+
+template<typename V>
+struct PavgbLevels<V, 0, 0> {
+    static __forceinline void run(V *, V) {}
+};
+
+//Draft blur: 2*radius levels of pairwise pavgb over the 2*radius+1 rows weight them binomially without
+//widening to 16 bits. With the rounding alternating the result is within a level of BlurRowSimd. Other
+//tap sets have no pavgb form and use the regular blur.
+template<typename Isa, typename Taps>
+struct BlurRowPavgb : BlurRowSimd<Isa, Taps> {};
+
+template<typename Isa, int radius>
+struct BlurRowPavgb<Isa, BinomialTaps<radius> > {
+    static __forceinline void run(uint8_t *dstp, const uint8_t *const *rows, int width) {
+        const auto zero = Isa::zero();
+        const auto flip = cmpeq_epi8(zero, zero);
+        for (int x = 0; x < width; x += Isa::width) {
+            typename Isa::V level[2 * radius + 1];
+            for (int k = 0; k <= 2 * radius; ++k) {
+                level[k] = Isa::load(rows[k] + x);
+            }
+            //after an even number of levels the result is back in the normal domain
+            PavgbLevels<typename Isa::V, 2 * radius, 0>::run(level, flip);
+            Isa::store(dstp + x, level[0]);
+        }
+    }
+};
+
+//A tap above the plane reads the row the same distance below instead and the other way round, mirrored
+//around the current row as the original blur3 and blur5 did. It's clamped only when that is outside too.
+template<int radius>
+static __forceinline void mirrored_rows(const uint8_t **rows, const uint8_t *srcp, int src_pitch, int height, int y) {
+    for (int k = -radius; k <= radius; ++k) {
+        int row = y + k;
+        if (row < 0 || row >= height) {
+            row = std::min(std::max(y - k, 0), height - 1);
+        }
+        rows[k + radius] = srcp + row * src_pitch;
+    }
+}
+
+//Blurs rows [y_begin, y_end). Rows whose taps are all inside the plane take the branch-free path, only
+//the first and last radius rows of the plane need mirroring.
+template<int radius, typename RowKernel>
+static void vertical_blur(uint8_t* dstp, const uint8_t *srcp, int dst_pitch, int src_pitch, int width, int height, int y_begin, int y_end) {
+    const uint8_t *rows[2 * radius + 1];
+    const int interior_begin = std::min(std::max(y_begin, radius), y_end);
+    const int interior_end = std::max(std::min(y_end, height - radius), interior_begin);
+
+    int y = y_begin;
+    for (; y < interior_begin; ++y) {
+        mirrored_rows<radius>(rows, srcp, src_pitch, height, y);
+        RowKernel::run(dstp + y * dst_pitch, rows, width);
+    }
+    for (; y < interior_end; ++y) {
+        const uint8_t *top = srcp + (y - radius) * src_pitch;
+        for (int k = 0; k <= 2 * radius; ++k) {
+            rows[k] = top + k * src_pitch;
+        }
+        RowKernel::run(dstp + y * dst_pitch, rows, width);
+    }
+    for (; y < y_end; ++y) {
+        mirrored_rows<radius>(rows, srcp, src_pitch, height, y);
+        RowKernel::run(dstp + y * dst_pitch, rows, width);
+    }
+}
+
+template<template<typename, typename> class RowKernel, typename Isa, template<int> class Taps>
+static void vertical_blur(int radius, uint8_t* dstp, const uint8_t *srcp, int dst_pitch, int src_pitch, int width, int height, int y_begin, int y_end) {
+    switch (radius) {
+    case 1: vertical_blur<1, RowKernel<Isa, Taps<1> > >(dstp, srcp, dst_pitch, src_pitch, width, height, y_begin, y_end); break;
+    case 2: vertical_blur<2, RowKernel<Isa, Taps<2> > >(dstp, srcp, dst_pitch, src_pitch, width, height, y_begin, y_end); break;
+    default: vertical_blur<3, RowKernel<Isa, Taps<3> > >(dstp, srcp, dst_pitch, src_pitch, width, height, y_begin, y_end); break;
+    }
+}
+
+template<template<typename, typename> class RowKernel, typename Isa>
+static void vertical_blur(BlurTaps taps, int radius, uint8_t* dstp, const uint8_t *srcp, int dst_pitch, int src_pitch, int width, int height, int y_begin, int y_end) {
+    if (taps == BlurTaps::Flat) {
+        vertical_blur<RowKernel, Isa, FlatTaps>(radius, dstp, srcp, dst_pitch, src_pitch, width, height, y_begin, y_end);
+    } else {
+        vertical_blur<RowKernel, Isa, BinomialTaps>(radius, dstp, srcp, dst_pitch, src_pitch, width, height, y_begin, y_end);
+    }
+}
+
+static void mt_makediff_c(uint8_t* dstp, const uint8_t *c1p, const uint8_t *c2p, int dst_pitch, int c1_pitch, int c2_pitch, int width, int height) {
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+            dstp[x] = std::max(std::min(c1p[x] - c2p[x] + 128, 255), 0);
+        }
+        dstp += dst_pitch;
+        c1p += c1_pitch;
+        c2p += c2_pitch;
+    }
+}
+
+//dst = rg11D, temp = rg11D.vblur()
+static void sbr_merge_c(uint8_t* dstp, const uint8_t* tempp, const uint8_t *srcp, int dst_pitch, int temp_pitch, int src_pitch, int width, int height) {
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+            int t = dstp[x]-tempp[x];
+            int t2 = dstp[x]-128;
+            if (t*t2 < 0) {
+                dstp[x] = srcp[x];
+            } else {
+                if (std::abs(t) < std::abs(t2)) {
+                    dstp[x] = srcp[x] - t;
+                } else {
+                    dstp[x] = srcp[x] - dstp[x] + 128;
+                }
+            }
+        }
+        dstp += dst_pitch;
+        srcp += src_pitch;
+        tempp += temp_pitch;
+    }
+}
+
+template<typename Isa>
+static void mt_makediff_simd(uint8_t* dstp, const uint8_t *c1p, const uint8_t *c2p, int dst_pitch, int c1_pitch, int c2_pitch, int width, int height) {
+    auto v128 = Isa::set1_epi8(char(0x80));
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; x += Isa::width) {
+            auto c1 = sub_epi8(Isa::load(c1p+x), v128);
+            auto c2 = sub_epi8(Isa::load(c2p+x), v128);
+
+            auto diff = subs_epi8(c1, c2);
+            diff = add_epi8(diff, v128);
+
+            Isa::store(dstp+x, diff);
+        }
+        dstp += dst_pitch;
+        c1p += c1_pitch;
+        c2p += c2_pitch;
+    }
+}
+
+//sbr merge of one half of a vector, widened to 16 bit lanes
+template<typename Isa>
+static __forceinline typename Isa::V sbr_merge_lanes(typename Isa::V dst, typename Isa::V temp, typename Isa::V src, typename Isa::V zero, typename Isa::V v128) {
+    auto t = subs_epi16(dst, temp);
+    auto t2 = subs_epi16(dst, v128);
+
+    auto nochange_mask = cmplt_epi16(mullo_epi16(t, t2), zero);
+
+    auto t_mask = cmplt_epi16(Isa::abs_epi16(t), Isa::abs_epi16(t2));
+    auto desired = subs_epi16(src, t);
+    auto otherwise = add_epi16(subs_epi16(src, dst), v128);
+    return Isa::blend(nochange_mask, src, Isa::blend(t_mask, desired, otherwise));
+}
+
+template<typename Isa>
+static void sbr_merge_simd(uint8_t* dstp, const uint8_t* tempp, const uint8_t *srcp, int dst_pitch, int temp_pitch, int src_pitch, int width, int height) {
+    auto zero = Isa::zero();
+    auto v128 = Isa::set1_epi16(128);
+
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; x += Isa::width) {
+            auto dst = Isa::load(dstp+x);
+            auto temp = Isa::load(tempp+x);
+            auto src = Isa::load(srcp+x);
+
+            auto lo = sbr_merge_lanes<Isa>(unpacklo_epi8(dst, zero), unpacklo_epi8(temp, zero), unpacklo_epi8(src, zero), zero, v128);
+            auto hi = sbr_merge_lanes<Isa>(unpackhi_epi8(dst, zero), unpackhi_epi8(temp, zero), unpackhi_epi8(src, zero), zero, v128);
+
+            Isa::store(dstp+x, packus_epi16(lo, hi));
+        }
+        dstp += dst_pitch;
+        srcp += src_pitch;
+        tempp += temp_pitch;
+    }
+}
+
+//Only columns [stats_begin, stats_end) of the rows are counted, the kernels are also run on padding
+//and on the extra rows around a region which don't end up in the output.
+template<typename Options>
+static void finalize_plane_c(uint8_t *dstp, uint8_t *auxp, const uint8_t* srcp, const uint8_t *pb3, const uint8_t *pb6, const int *dlut, int dst_pitch, int aux_pitch, int src_pitch, int pb3_pitch, int pb_pitch, int width, int height, int amnt,
+                             float sstr, FrameStats *stats, int stats_begin, int stats_end) {
+    const bool amnt_255 = Options::amnt_255;
+    const bool with_stats = Options::with_stats;
+    uint64_t change = 0, clamped = 0, scaled = 0;
+    for (int y=0; y<height; ++y)
+    {
+        for (int x=0; x<width; ++x)
+        {
+            const int d1 = srcp[x]-pb3[x]+255;
+            const int d2 = pb3[x]-pb6[x]+255;
+            const int df = pb3[x]+dlut[(d1<<9)+d2];
+
+            int minm, maxm;
+            if (amnt_255) {
+                minm = 0;
+                maxm = 255;
+            } else {
+                minm = std::max(srcp[x]-amnt,0);
+                maxm = std::min(srcp[x]+amnt,255);
+            }
+
+            if (df <= minm) dstp[x] = minm;
+            else if (df >= maxm) dstp[x] = maxm;
+            else dstp[x] = df;
+
+            if (with_stats && x >= stats_begin && x < stats_end) {
+                change += abs(dstp[x] - srcp[x]);
+                clamped += df < minm || df > maxm;
+                //same test the dlut is built with
+                scaled += float(d1 - 255) * ((d2 - 255) * sstr) < 0.0;
+            }
+
+            if (Options::aux == AuxOutput::Difference) {
+                auxp[x] = std::min(std::max(d1 - 255 + 128, 0), 255);
+            } else if (Options::aux == AuxOutput::Changed) {
+                auxp[x] = dstp[x] != srcp[x] ? 255 : 0;
+            }
+        }
+        srcp += src_pitch;
+        pb3 += pb3_pitch;
+        pb6 += pb_pitch;
+        dstp += dst_pitch;
+        auxp += aux_pitch;
+    }
+    if (with_stats) {
+        stats->change += change;
+        stats->clamped += clamped;
+        stats->scaled += scaled;
+    }
+}
+
+template<typename Isa, bool streaming>
+static __forceinline void store_vector(uint8_t *p, typename Isa::V x) {
+    if (streaming) {
+        Isa::stream(p, x);
+    } else {
+        Isa::store(p, x);
+    }
+}
+
+//What the finalize math produces for one half of a vector, in 16 bit lanes
+template<typename Isa>
+struct FinalizeLanes {
+    typename Isa::V unclamped;  //blur3 + the limited difference, before amnt and the 0-255 range
+    typename Isa::V scaled;     //all ones where the opposite signs of the two differences made scl apply
+    typename Isa::V d1;         //src - blur3
+};
+
+template<typename Isa>
+struct FinalizeFloat {
+    typedef typename Isa::V V;
+    typedef typename Isa::F F;
+
+    FinalizeFloat(float sstr, float scl) : zero(Isa::zero()), zero_ps(Isa::set1_ps(0.0f)), sstr_vector(Isa::set1_ps(sstr)), scl_vector(Isa::set1_ps(scl)) {}
+
+    __forceinline void run(V b3, V b6, V src, FinalizeLanes<Isa> &out) const {
+        auto d1i = subs_epi16(src, b3);
+        auto d2i = subs_epi16(b3, b6);
+        auto d1i_sign = cmplt_epi16(d1i, zero);
+        auto d2i_sign = cmplt_epi16(d2i, zero);
+
+        F fin_mask_lo, fin_mask_hi;
+        auto add_lo = limited_difference(cvtepi32_ps(unpacklo_epi16(d1i, d1i_sign)), cvtepi32_ps(unpacklo_epi16(d2i, d2i_sign)), fin_mask_lo);
+        auto add_hi = limited_difference(cvtepi32_ps(unpackhi_epi16(d1i, d1i_sign)), cvtepi32_ps(unpackhi_epi16(d2i, d2i_sign)), fin_mask_hi);
+
+        out.unclamped = add_epi16(b3, packs_epi32(cvttps_epi32(add_lo), cvttps_epi32(add_hi)));
+        out.scaled = packs_epi32(castps_si(fin_mask_lo), castps_si(fin_mask_hi));
+        out.d1 = d1i;
+    }
+
+    __forceinline F limited_difference(F d1, F d2, F &fin_mask) const {
+        auto t = mul_ps(d2, sstr_vector);
+        auto da_mask = cmplt_ps(abs_ps(d1), abs_ps(t));
+        auto da = Isa::blend_ps(da_mask, d1, t);
+        fin_mask = cmplt_ps(mul_ps(d1, t), zero_ps);
+        return Isa::blend_ps(fin_mask, mul_ps(da, scl_vector), da);
+    }
+
+    V zero;
+    F zero_ps;
+    F sstr_vector;
+    F scl_vector;
+};
+
+//Draft finalize: the same steps in 16 bit integers. sstr and scl become 9 bit fixed point factors
+//applied with pmulhw, so products are floored to whole values where the float version keeps fractions
+//until the final truncation. Together with the pavgb blurs the mean difference to the full quality output
+//is below 1.1 levels on combed footage, but sstr amplifies the rounding of the blurs: single pixels
+//measured up to 9 levels off on combed footage and up to 30 on noise.
+template<typename Isa>
+struct FinalizeFixed {
+    typedef typename Isa::V V;
+
+    //(x << 7) * (f * 512) >> 16 = x * f; x << 7 fits 16 bits for |x| <= 255
+    FinalizeFixed(float sstr, float scl)
+    : zero(Isa::zero()),
+      sstr_vector(Isa::set1_epi16(short(std::min(std::max(sstr * 512.0f, -32768.0f), 32767.0f)))),
+      scl_vector(Isa::set1_epi16(short(std::min(std::max(scl * 512.0f, -32768.0f), 32767.0f)))) {}
+
+    __forceinline void run(V b3, V b6, V src, FinalizeLanes<Isa> &out) const {
+        auto d1 = sub_epi16(src, b3);
+        auto d2 = sub_epi16(b3, b6);
+        //|d2 * sstr| can exceed 255, but 255 * 64 still fits
+        auto t = mulhi_epi16(slli_epi16<7>(d2), sstr_vector);
+
+        auto da_mask = cmplt_epi16(Isa::abs_epi16(d1), Isa::abs_epi16(t));
+        auto da = Isa::blend(da_mask, d1, t);
+        auto desired = mulhi_epi16(slli_epi16<7>(da), scl_vector);
+
+        //d1 * t < 0
+        auto fin_mask = or_si(and_si(cmpgt_epi16(d1, zero), cmplt_epi16(t, zero)),
+                              and_si(cmplt_epi16(d1, zero), cmpgt_epi16(t, zero)));
+
+        out.unclamped = add_epi16(b3, Isa::blend(fin_mask, desired, da));
+        out.scaled = fin_mask;
+        out.d1 = d1;
+    }
+
+    V zero;
+    V sstr_vector;
+    V scl_vector;
+};
+
+//Stats of the simd finalize passes for one vector of pixels. clamped and scaled are counted per byte lane
+//and summed into the 64 bit totals with psadbw before a lane can wrap, every 255 vectors. Only vectors on the
+//edges of the counted columns are masked.
+template<typename Isa>
+struct BlockStats {
+    typedef typename Isa::V V;
+
+    BlockStats(int stats_begin, int stats_end)
+    : stats_begin(stats_begin), stats_end(stats_end), pending(0),
+      zero(Isa::zero()), all_lanes(cmpeq_epi8(zero, zero)),
+      change_total(zero), clamped_total(zero), scaled_total(zero), clamped_bytes(zero), scaled_bytes(zero) {}
+
+    //result and src are the packed output and source, lo and hi the finalize math of their two halves.
+    //A pixel was clamped if amnt or the 0-255 range changed it, that is if result differs from unclamped.
+    __forceinline void add(int x, V result, V src, const FinalizeLanes<Isa> &lo, const FinalizeLanes<Isa> &hi) {
+        auto kept = packs_epi16(cmpeq_epi16(lo.unclamped, unpacklo_epi8(result, zero)), cmpeq_epi16(hi.unclamped, unpackhi_epi8(result, zero)));
+        auto scaled = packs_epi16(lo.scaled, hi.scaled);
+        auto valid = all_lanes;
+        if (x < stats_begin || x + Isa::width > stats_end) {
+            valid = edge_mask(x);
+            result = and_si(result, valid);
+            src = and_si(src, valid);
+            scaled = and_si(scaled, valid);
+        }
+        change_total = add_epi64(change_total, sad_epu8(result, src));
+        clamped_bytes = sub_epi8(clamped_bytes, andnot_si(kept, valid));
+        scaled_bytes = sub_epi8(scaled_bytes, scaled);
+        if (++pending == 255) {
+            reduce();
+        }
+    }
+
+    V edge_mask(int x) const {
+        uint8_t lanes[Isa::width];
+        for (int i = 0; i < Isa::width; ++i) {
+            lanes[i] = x + i >= stats_begin && x + i < stats_end ? 0xFF : 0;
+        }
+        return Isa::loadu(lanes);
+    }
+
+    __forceinline void reduce() {
+        clamped_total = add_epi64(clamped_total, sad_epu8(clamped_bytes, zero));
+        scaled_total = add_epi64(scaled_total, sad_epu8(scaled_bytes, zero));
+        clamped_bytes = zero;
+        scaled_bytes = zero;
+        pending = 0;
+    }
+
+    void flush(FrameStats *stats) {
+        reduce();
+        stats->change += hsum_epi64(change_total);
+        stats->clamped += hsum_epi64(clamped_total);
+        stats->scaled += hsum_epi64(scaled_total);
+    }
+
+    int stats_begin;
+    int stats_end;
+    int pending;
+    V zero;
+    V all_lanes;
+    V change_total;
+    V clamped_total;
+    V scaled_total;
+    V clamped_bytes;
+    V scaled_bytes;
+};
+
+//Math is FinalizeFloat or FinalizeFixed, the rest is shared: clamping, stats and the aux output
+template<typename Isa, typename Options, typename Math>
+static void finalize_plane_simd(uint8_t *dstp, uint8_t *auxp, const uint8_t* srcp, const uint8_t *pb3, const uint8_t *pb6, const Math &math, int dst_pitch, int aux_pitch, int src_pitch, int pb3_pitch, int pb_pitch, int width, int height, int amnt,
+                                FrameStats *stats, int stats_begin, int stats_end) {
+    const bool amnt_255 = Options::amnt_255;
+    const bool with_stats = Options::with_stats;
+    const bool streaming = Options::streaming;
+
+    auto zero = Isa::zero();
+    auto amnt_vector = Isa::set1_epi16(short(amnt));
+    auto all_lanes = cmpeq_epi8(zero, zero);
+    auto v128 = Isa::set1_epi16(128);
+    BlockStats<Isa> counts(stats_begin, stats_end);
+
+    for (int y = 0; y < height; ++y)
+    {
+        for (int x = 0; x < width; x += Isa::width)
+        {
+            auto b3 = Isa::load(pb3 + x);
+            auto b6 = Isa::load(pb6 + x);
+            auto src = Isa::load(srcp + x);
+            auto src_lo = unpacklo_epi8(src, zero);
+            auto src_hi = unpackhi_epi8(src, zero);
+
+            FinalizeLanes<Isa> lo, hi;
+            math.run(unpacklo_epi8(b3, zero), unpacklo_epi8(b6, zero), src_lo, lo);
+            math.run(unpackhi_epi8(b3, zero), unpackhi_epi8(b6, zero), src_hi, hi);
+
+            auto df_lo = lo.unclamped;
+            auto df_hi = hi.unclamped;
+            //with amnt=255 the [src-amnt, src+amnt] range covers [0, 255] and packus alone clamps
+            if (!amnt_255) {
+                df_lo = min_epi16(max_epi16(df_lo, subs_epi16(src_lo, amnt_vector)), adds_epi16(src_lo, amnt_vector));
+                df_hi = min_epi16(max_epi16(df_hi, subs_epi16(src_hi, amnt_vector)), adds_epi16(src_hi, amnt_vector));
+            }
+
+            auto result = packus_epi16(df_lo, df_hi);
+            store_vector<Isa, streaming>(dstp + x, result);
+
+            if (with_stats) {
+                counts.add(x, result, src, lo, hi);
+            }
+
+            if (Options::aux == AuxOutput::Difference) {
+                store_vector<Isa, streaming>(auxp + x, packus_epi16(add_epi16(lo.d1, v128), add_epi16(hi.d1, v128)));
+            } else if (Options::aux == AuxOutput::Changed) {
+                store_vector<Isa, streaming>(auxp + x, andnot_si(cmpeq_epi8(result, src), all_lanes));
+            }
+        }
+        srcp += src_pitch;
+        pb3 += pb3_pitch;
+        pb6 += pb_pitch;
+        dstp += dst_pitch;
+        auxp += aux_pitch;
+    }
+    //the stores are weakly ordered, they have to be visible before the frame is handed on
+    if (streaming) {
+        _mm_sfence();
+    }
+    if (with_stats) {
+        counts.flush(stats);
+    }
+}
+
+//Kernel sets the plane pipeline is instantiated with. Everything is resolved at compile time so each
+//pipeline variant has its stage kernels inlined without any per-call dispatch.
+struct PlainKernels {
+    enum { alignment = 1, uses_lut = 1 };
+
+    static __forceinline void blur(BlurTaps taps, int radius, uint8_t* dstp, const uint8_t *srcp, int dst_pitch, int src_pitch, int width, int height, int y_begin, int y_end) {
+        vertical_blur<BlurRowC, void>(taps, radius, dstp, srcp, dst_pitch, src_pitch, width, height, y_begin, y_end);
+    }
+
+    static __forceinline void makediff(uint8_t* dstp, const uint8_t *c1p, const uint8_t *c2p, int dst_pitch, int c1_pitch, int c2_pitch, int width, int height) {
+        mt_makediff_c(dstp, c1p, c2p, dst_pitch, c1_pitch, c2_pitch, width, height);
+    }
+
+    static __forceinline void sbr_merge(uint8_t* dstp, const uint8_t* tempp, const uint8_t *srcp, int dst_pitch, int temp_pitch, int src_pitch, int width, int height) {
+        sbr_merge_c(dstp, tempp, srcp, dst_pitch, temp_pitch, src_pitch, width, height);
+    }
+
+    template<typename Options>
+    static __forceinline void finalize(uint8_t *dstp, uint8_t *auxp, const uint8_t* srcp, const uint8_t *pb3, const uint8_t *pb6, float sstr, float, const int *dlut, int dst_pitch, int aux_pitch, int src_pitch, int pb3_pitch, int pb_pitch, int width, int height, int amnt,
+                                       FrameStats *stats, int stats_begin, int stats_end) {
+        //no non-temporal stores in plain C, the streaming variant is the regular one
+        typedef FinalizeOptions<Options::amnt_255, Options::with_stats, Options::aux> Regular;
+        finalize_plane_c<Regular>(dstp, auxp, srcp, pb3, pb6, dlut, dst_pitch, aux_pitch, src_pitch, pb3_pitch, pb_pitch, width, height, amnt, sstr, stats, stats_begin, stats_end);
+    }
+};
+
+//Each stage runs over the columns that fill whole vectors of the tier, then a wider tier does the rest
+//of the row with its 128 bit half.
+template<typename Isa>
+struct SimdKernels {
+    typedef typename Isa::Half Half;
+    enum { alignment = 16, uses_lut = 0 };
+
+    static __forceinline void blur(BlurTaps taps, int radius, uint8_t* dstp, const uint8_t *srcp, int dst_pitch, int src_pitch, int width, int height, int y_begin, int y_end) {
+        blur_with<BlurRowSimd>(taps, radius, dstp, srcp, dst_pitch, src_pitch, width, height, y_begin, y_end);
+    }
+
+    static __forceinline void makediff(uint8_t* dstp, const uint8_t *c1p, const uint8_t *c2p, int dst_pitch, int c1_pitch, int c2_pitch, int width, int height) {
+        const int wide = wide_columns<Isa>(width);
+        mt_makediff_simd<Isa>(dstp, c1p, c2p, dst_pitch, c1_pitch, c2_pitch, wide, height);
+        if (wide < width) {
+            Isa::leave();
+            mt_makediff_simd<Half>(dstp + wide, c1p + wide, c2p + wide, dst_pitch, c1_pitch, c2_pitch, width - wide, height);
+        }
+        Isa::leave();
+    }
+
+    static __forceinline void sbr_merge(uint8_t* dstp, const uint8_t* tempp, const uint8_t *srcp, int dst_pitch, int temp_pitch, int src_pitch, int width, int height) {
+        const int wide = wide_columns<Isa>(width);
+        sbr_merge_simd<Isa>(dstp, tempp, srcp, dst_pitch, temp_pitch, src_pitch, wide, height);
+        if (wide < width) {
+            Isa::leave();
+            sbr_merge_simd<Half>(dstp + wide, tempp + wide, srcp + wide, dst_pitch, temp_pitch, src_pitch, width - wide, height);
+        }
+        Isa::leave();
+    }
+
+    template<typename Options>
+    static __forceinline void finalize(uint8_t *dstp, uint8_t *auxp, const uint8_t* srcp, const uint8_t *pb3, const uint8_t *pb6, float sstr, float scl, const int *, int dst_pitch, int aux_pitch, int src_pitch, int pb3_pitch, int pb_pitch, int width, int height, int amnt,
+                                       FrameStats *stats, int stats_begin, int stats_end) {
+        finalize_with<Options, FinalizeFloat>(dstp, auxp, srcp, pb3, pb6, sstr, scl, dst_pitch, aux_pitch, src_pitch, pb3_pitch, pb_pitch, width, height, amnt, stats, stats_begin, stats_end);
+    }
+
+    template<template<typename, typename> class RowKernel>
+    static __forceinline void blur_with(BlurTaps taps, int radius, uint8_t* dstp, const uint8_t *srcp, int dst_pitch, int src_pitch, int width, int height, int y_begin, int y_end) {
+        const int wide = wide_columns<Isa>(width);
+        vertical_blur<RowKernel, Isa>(taps, radius, dstp, srcp, dst_pitch, src_pitch, wide, height, y_begin, y_end);
+        if (wide < width) {
+            Isa::leave();
+            vertical_blur<RowKernel, Half>(taps, radius, dstp + wide, srcp + wide, dst_pitch, src_pitch, width - wide, height, y_begin, y_end);
+        }
+        Isa::leave();
+    }
+
+    template<typename Options, template<typename> class Math>
+    static __forceinline void finalize_with(uint8_t *dstp, uint8_t *auxp, const uint8_t* srcp, const uint8_t *pb3, const uint8_t *pb6, float sstr, float scl, int dst_pitch, int aux_pitch, int src_pitch, int pb3_pitch, int pb_pitch, int width, int height, int amnt,
+                                            FrameStats *stats, int stats_begin, int stats_end) {
+        const int wide = wide_columns<Isa>(width);
+        finalize_plane_simd<Isa, Options>(dstp, auxp, srcp, pb3, pb6, Math<Isa>(sstr, scl), dst_pitch, aux_pitch, src_pitch, pb3_pitch, pb_pitch, wide, height, amnt, stats, stats_begin, stats_end);
+        if (wide < width) {
+            Isa::leave();
+            finalize_plane_simd<Half, Options>(dstp + wide, auxp != nullptr ? auxp + wide : nullptr, srcp + wide, pb3 + wide, pb6 + wide, Math<Half>(sstr, scl), dst_pitch, aux_pitch, src_pitch, pb3_pitch, pb_pitch, width - wide, height, amnt,
+                stats, stats_begin - wide, stats_end - wide);
+        }
+        Isa::leave();
+    }
+};
+
+//Fast path for previews: pavgb blurs and the integer finalize, the other stages are shared with SimdKernels
+template<typename Isa>
+struct DraftKernels : SimdKernels<Isa> {
+    static __forceinline void blur(BlurTaps taps, int radius, uint8_t* dstp, const uint8_t *srcp, int dst_pitch, int src_pitch, int width, int height, int y_begin, int y_end) {
+        SimdKernels<Isa>::template blur_with<BlurRowPavgb>(taps, radius, dstp, srcp, dst_pitch, src_pitch, width, height, y_begin, y_end);
+    }
+
+    template<typename Options>
+    static __forceinline void finalize(uint8_t *dstp, uint8_t *auxp, const uint8_t* srcp, const uint8_t *pb3, const uint8_t *pb6, float sstr, float scl, const int *, int dst_pitch, int aux_pitch, int src_pitch, int pb3_pitch, int pb_pitch, int width, int height, int amnt,
+                                       FrameStats *stats, int stats_begin, int stats_end) {
+        SimdKernels<Isa>::template finalize_with<Options, FinalizeFixed>(dstp, auxp, srcp, pb3, pb6, sstr, scl, dst_pitch, aux_pitch, src_pitch, pb3_pitch, pb_pitch, width, height, amnt, stats, stats_begin, stats_end);
+    }
+};
+
+}
+
+//Part of a plane to filter, everything outside is copied from the source. With a mask, a row of the
+//region is only filtered when the mask has a non-zero pixel in it.
+struct PlaneRegion {
+    int x;
+    int y;
+    int width;
+    int height;
+    const uint8_t *maskp;
+    int mask_pitch;
+};
+
+static bool is_row_masked_out(const PlaneRegion &region, int y) {
+    if (region.maskp == nullptr) {
+        return false;
+    }
+    const uint8_t *maskp = region.maskp + y * region.mask_pitch;
+    for (int x = region.x; x < region.x + region.width; ++x) {
+        if (maskp[x] != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+struct PlaneDesc {
+    uint8_t *dstp;
+    const uint8_t *srcp;
+    int dst_pitch;
+    int src_pitch;
+    int width;
+    int height;
+    bool luma;
+    PlaneRegion region;
+    uint8_t *auxp;  //nullptr without aux output
+    int aux_pitch;
+};
+
+class PlanePipeline;
+typedef void (*PlaneStepFunction)(PlanePipeline &pipeline);
+
+struct PipelineParams {
+    VinverseMode mode;
+    PlaneStepFunction step;
+    float sstr;
+    float scl;
+    int amnt;
+    const int *dlut;
+    int tile_width;
+    int radius1;    //vinverse: blur3, vinverse2: rg11 and the blur of its difference
+    int radius2;    //vinverse: blur5, vinverse2: the final blur
+    BlurTaps taps;
+    //only read by the stats variants, rows and columns of the pipeline's plane that count towards them
+    FrameStats *stats;
+    PlaneRegion counted;
+};
+
+//Push-style processing of one plane. Source rows are fed as they become available and every stage
+//runs as far as its vertical lookahead allows, so output rows are final a few rows after the source
+//rows they depend on instead of after the whole plane. The last rows are flushed once all rows are in.
+//All filters are vertical, so each strip can also be split into independent column tiles.
+class PlanePipeline {
+public:
+    PlanePipeline(const PipelineParams &params, const PlaneDesc &plane, uint8_t *blur3_buffer, uint8_t *blur6_buffer, int pb_pitch);
+
+    //returns the number of finished output rows from the top of the plane
+    int push_rows(int count);
+    int finished_rows() const { return done[BLUR6]; }
+
+    //advances every stage as far as the pushed rows allow, one instantiation per kernel set and plane role
+    template<typename Kernels, VinverseMode mode, bool luma, typename Options>
+    static void step(PlanePipeline &pipeline);
+
+private:
+    enum Stage {
+        BLUR3,      //vinverse: blur3 of the source, vinverse2: rg11
+        DIFF,       //rg11D
+        DIFF_BLUR,  //rg11D.vblur()
+        SBR,
+        BLUR6,      //also the finalized rows
+        STAGE_COUNT
+    };
+
+    template<typename Kernels, VinverseMode mode, bool luma, typename Options>
+    void run_tile(int x, int width);
+    template<typename Kernels>
+    void blur(Stage stage, int radius, uint8_t *dstp, const uint8_t *srcp, int dst_pitch, int src_pitch, int x, int width);
+    template<typename Kernels>
+    void makediff(int x, int width);
+    template<typename Kernels>
+    void sbr_merge(int x, int width);
+    template<typename Kernels, typename Options>
+    void finalize(int x, int width);
+    template<typename Kernels, typename Options>
+    void finalize_rows(int x, int width, int y_begin, int y_end);
+
+    int rows_ready(int input_rows, int radius) const {
+        return input_rows == plane_.height ? input_rows : std::max(input_rows - radius, 0);
+    }
+
+    PipelineParams params_;
+    PlaneDesc plane_;
+
+    uint8_t *blur3_buffer, *blur6_buffer;
+    const uint8_t *pb3;
+    int pb3_pitch;
+    int pb_pitch;
+
+    int src_rows;
+    int done[STAGE_COUNT];
+    int next[STAGE_COUNT];
+};
+
+template<typename Kernels, VinverseMode mode, bool luma, typename Options>
+void PlanePipeline::step(PlanePipeline &p) {
+    const int radius1 = p.params_.radius1;
+    const int radius2 = p.params_.radius2;
+    if (mode == VinverseMode::Vinverse) {
+        p.next[BLUR3] = p.rows_ready(p.src_rows, radius1);
+        p.next[BLUR6] = p.rows_ready(p.next[BLUR3], radius2);
+    } else {
+        if (luma) {
+            p.next[BLUR3] = p.rows_ready(p.src_rows, radius1);
+            p.next[DIFF] = p.next[BLUR3];
+            p.next[DIFF_BLUR] = p.rows_ready(p.next[DIFF], radius1);
+            //merging overwrites rg11D, so it has to wait until no pending vblur row reads it
+            p.next[SBR] = p.rows_ready(p.next[DIFF_BLUR], radius1);
+        } else {
+            p.next[SBR] = p.src_rows;
+        }
+        p.next[BLUR6] = p.rows_ready(p.next[SBR], radius2);
+    }
+
+    if (p.next[BLUR6] > p.done[BLUR6]) {
+        const int width = p.plane_.width;
+        const int tile_width = p.params_.tile_width > 0 ? p.params_.tile_width : width;
+        for (int x = 0; x < width; x += tile_width) {
+            p.run_tile<Kernels, mode, luma, Options>(x, std::min(tile_width, width - x));
+        }
+        std::copy(p.next, p.next + STAGE_COUNT, p.done);
+    }
+}
+
+template<typename Kernels, VinverseMode mode, bool luma, typename Options>
+void PlanePipeline::run_tile(int x, int width) {
+    if (mode == VinverseMode::Vinverse) {
+        blur<Kernels>(BLUR3, params_.radius1, blur3_buffer, plane_.srcp, pb_pitch, plane_.src_pitch, x, width);
+        blur<Kernels>(BLUR6, params_.radius2, blur6_buffer, blur3_buffer, pb_pitch, pb_pitch, x, width);
+    } else {
+        if (luma) {
+            //blur6_buffer is temp storage for sbr: rg11, then rg11D.vblur(), then the final blur
+            blur<Kernels>(BLUR3, params_.radius1, blur6_buffer, plane_.srcp, pb_pitch, plane_.src_pitch, x, width);
+            makediff<Kernels>(x, width);
+            blur<Kernels>(DIFF_BLUR, params_.radius1, blur6_buffer, blur3_buffer, pb_pitch, pb_pitch, x, width);
+            sbr_merge<Kernels>(x, width);
+        }
+        blur<Kernels>(BLUR6, params_.radius2, blur6_buffer, pb3, pb_pitch, pb3_pitch, x, width);
+    }
+    finalize<Kernels, Options>(x, width);
+}
+
+template<typename Kernels>
+void PlanePipeline::blur(Stage stage, int radius, uint8_t *dstp, const uint8_t *srcp, int dst_pitch, int src_pitch, int x, int width) {
+    Kernels::blur(params_.taps, radius, dstp + x, srcp + x, dst_pitch, src_pitch, width, plane_.height, done[stage], next[stage]);
+}
+
+template<typename Kernels>
+void PlanePipeline::makediff(int x, int width) {
+    const int y = done[DIFF];
+    const int height = next[DIFF] - y;
+    if (height <= 0) {
+        return;
+    }
+    uint8_t *dstp = blur3_buffer + y * pb_pitch + x;
+    const uint8_t *srcp = plane_.srcp + y * plane_.src_pitch + x;
+    const uint8_t *tempp = blur6_buffer + y * pb_pitch + x;
+
+    Kernels::makediff(dstp, srcp, tempp, pb_pitch, plane_.src_pitch, pb_pitch, width, height);
+}
+
+template<typename Kernels>
+void PlanePipeline::sbr_merge(int x, int width) {
+    const int y = done[SBR];
+    const int height = next[SBR] - y;
+    if (height <= 0) {
+        return;
+    }
+    uint8_t *dstp = blur3_buffer + y * pb_pitch + x;
+    const uint8_t *tempp = blur6_buffer + y * pb_pitch + x;
+    const uint8_t *srcp = plane_.srcp + y * plane_.src_pitch + x;
+
+    Kernels::sbr_merge(dstp, tempp, srcp, pb_pitch, pb_pitch, plane_.src_pitch, width, height);
+}
+
+template<typename Kernels, typename Options>
+void PlanePipeline::finalize(int x, int width) {
+    const int y = done[BLUR6];
+    const int height = next[BLUR6] - y;
+    if (height <= 0) {
+        return;
+    }
+
+    if (Options::with_stats) {
+        //rows outside the counted ones are finalized without stats, and so are masked-out rows that
+        //were filtered only because they lie between two masked-in ones
+        const PlaneRegion &counted = params_.counted;
+        const int top = std::min(std::max(counted.y, y), y + height);
+        const int bottom = std::max(std::min(counted.y + counted.height, y + height), top);
+        finalize_rows<Kernels, typename Options::without_stats>(x, width, y, top);
+        if (counted.maskp == nullptr) {
+            finalize_rows<Kernels, Options>(x, width, top, bottom);
+        } else {
+            for (int row = top; row < bottom; ) {
+                const bool masked_out = is_row_masked_out(counted, row);
+                int run_end = row + 1;
+                while (run_end < bottom && is_row_masked_out(counted, run_end) == masked_out) {
+                    ++run_end;
+                }
+                if (masked_out) {
+                    finalize_rows<Kernels, typename Options::without_stats>(x, width, row, run_end);
+                } else {
+                    finalize_rows<Kernels, Options>(x, width, row, run_end);
+                }
+                row = run_end;
+            }
+        }
+        finalize_rows<Kernels, typename Options::without_stats>(x, width, bottom, y + height);
+    } else {
+        finalize_rows<Kernels, Options>(x, width, y, y + height);
+    }
+}
+
+template<typename Kernels, typename Options>
+void PlanePipeline::finalize_rows(int x, int width, int y_begin, int y_end) {
+    if (y_end <= y_begin) {
+        return;
+    }
+    uint8_t *dstp = plane_.dstp + y_begin * plane_.dst_pitch + x;
+    uint8_t *auxp = Options::aux != AuxOutput::None ? plane_.auxp + y_begin * plane_.aux_pitch + x : nullptr;
+    const uint8_t *srcp = plane_.srcp + y_begin * plane_.src_pitch + x;
+    const uint8_t *pb3p = pb3 + y_begin * pb3_pitch + x;
+    const uint8_t *pb6p = blur6_buffer + y_begin * pb_pitch + x;
+    const int stats_begin = params_.counted.x - x;
+    const int stats_end = params_.counted.x + params_.counted.width - x;
+
+    Kernels::template finalize<Options>(dstp, auxp, srcp, pb3p, pb6p, params_.sstr, params_.scl, params_.dlut, plane_.dst_pitch, plane_.aux_pitch, plane_.src_pitch, pb3_pitch, pb_pitch, width, y_end - y_begin, params_.amnt,
+        params_.stats, stats_begin, stats_end);
+}
+
+//pipeline variants for one filter instance, picked once at construction
+struct PlaneSteps {
+    int alignment;
+    bool uses_lut;
+    PlaneStepFunction luma;
+    PlaneStepFunction chroma;
+    //same with the output written by non-temporal stores
+    PlaneStepFunction luma_streaming;
+    PlaneStepFunction chroma_streaming;
+};
+
+template<typename Kernels, VinverseMode mode, typename Options>
+static PlaneSteps make_plane_steps() {
+    PlaneSteps steps;
+    steps.alignment = Kernels::alignment;
+    steps.uses_lut = Kernels::uses_lut != 0;
+    steps.luma = &PlanePipeline::step<Kernels, mode, true, Options>;
+    //vinverse treats all planes the same
+    steps.chroma = &PlanePipeline::step<Kernels, mode, mode == VinverseMode::Vinverse, Options>;
+    steps.luma_streaming = &PlanePipeline::step<Kernels, mode, true, typename Options::with_streaming>;
+    steps.chroma_streaming = &PlanePipeline::step<Kernels, mode, mode == VinverseMode::Vinverse, typename Options::with_streaming>;
+    return steps;
+}
+
+template<typename Kernels, VinverseMode mode, bool amnt_255, bool with_stats>
+static PlaneSteps make_plane_steps(AuxOutput aux) {
+    switch (aux) {
+    case AuxOutput::Difference: return make_plane_steps<Kernels, mode, FinalizeOptions<amnt_255, with_stats, AuxOutput::Difference> >();
+    case AuxOutput::Changed: return make_plane_steps<Kernels, mode, FinalizeOptions<amnt_255, with_stats, AuxOutput::Changed> >();
+    default: return make_plane_steps<Kernels, mode, FinalizeOptions<amnt_255, with_stats, AuxOutput::None> >();
+    }
+}
+
+template<typename Kernels, VinverseMode mode>
+static PlaneSteps make_plane_steps(bool amnt_255, bool with_stats, AuxOutput aux) {
+    if (amnt_255) {
+        return with_stats ? make_plane_steps<Kernels, mode, true, true>(aux) : make_plane_steps<Kernels, mode, true, false>(aux);
+    }
+    return with_stats ? make_plane_steps<Kernels, mode, false, true>(aux) : make_plane_steps<Kernels, mode, false, false>(aux);
+}
+
+template<typename Kernels>
+static PlaneSteps make_plane_steps(VinverseMode mode, bool amnt_255, bool with_stats, AuxOutput aux) {
+    if (mode == VinverseMode::Vinverse) {
+        return make_plane_steps<Kernels, VinverseMode::Vinverse>(amnt_255, with_stats, aux);
+    }
+    return make_plane_steps<Kernels, VinverseMode::Vinverse2>(amnt_255, with_stats, aux);
+}
+
+//The AVX2 tier, from vinverse_avx2.cpp
+PlaneSteps make_avx2_plane_steps(VinverseMode mode, bool amnt_255, bool with_stats, AuxOutput aux);
+PlaneSteps make_avx2_draft_steps(VinverseMode mode, bool amnt_255, bool with_stats, AuxOutput aux);
+
+#endif